@@ -0,0 +1,315 @@
+/* Apple-1 cassette (ACI) audio, read and written as WAV files.
+ *
+ * The ACI records each address range as its own record:
+ *   leader - about 10 seconds of 1000 Hz
+ *   sync   - a 200us half cycle followed by a 250us half cycle
+ *   data   - each byte MSB first, a 1 is one cycle of 1000 Hz and a 0 is
+ *            one cycle of 2000 Hz
+ * The ACI doesn't store the length of a record, the reader just reads as
+ * many bytes as its address range needs. The writer here leaves a short
+ * silence after each record so a record can also be read without knowing
+ * its length (as wav2bin does), ending at the silence.
+ *
+ * The writer streams square waves straight out as 8-bit mono samples.
+ * The reader accepts 8 or 16-bit PCM at any rate, using the first channel,
+ * and measures the time between zero crossings. A little hysteresis
+ * around zero keeps noise in quiet parts from counting as crossings.
+ * The decoder is a plain scalar loop rather than SIMD on purpose. Each
+ * crossing depends on the hysteresis state left by the previous sample,
+ * and a minute of audio already decodes in about 15ms.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define WAV_RATE 44100
+#define LEADER_MICROS 10000000
+#define SILENCE_MICROS 500000
+
+#define LONG_HALF 500       // 1000 Hz, leader and 1 bits
+#define SHORT_HALF 250      // 2000 Hz, 0 bits and the end of sync
+#define SYNC_HALF 200       // 2500 Hz, start of sync
+
+// Reader thresholds, all in microseconds
+#define SHORT_HALF_MAX 350  // shorter than this is a sync half
+#define ZERO_CYCLE_MAX 750  // a full cycle shorter than this is a 0
+#define GAP_MIN 2000        // a half cycle longer than this ends a record
+#define LEADER_MIN 200      // long half cycles needed before a sync
+
+// Samples within this distance of zero don't change the level
+#define HYSTERESIS 1024
+
+static void put_le(uint8_t *p, uint32_t value, int bytes) {
+    for (int i=0; i < bytes; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t get_le(uint8_t *p, int bytes) {
+    uint32_t value = 0;
+    for (int i=bytes-1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+/* Writer state */
+static uint8_t out_buffer[8192];
+static int out_len;
+static uint32_t out_samples;    // samples written so far
+static uint64_t out_micros;     // time at the end of the last half cycle
+static uint8_t out_level;
+
+static void write_header(FILE *out, uint32_t samples) {
+    uint8_t header[44];
+
+    memcpy(header, "RIFF", 4);
+    put_le(header+4, 36 + samples + (samples & 1), 4);  // includes the pad byte
+    memcpy(header+8, "WAVEfmt ", 8);
+    put_le(header+16, 16, 4);           // fmt chunk size
+    put_le(header+20, 1, 2);            // PCM
+    put_le(header+22, 1, 2);            // mono
+    put_le(header+24, WAV_RATE, 4);
+    put_le(header+28, WAV_RATE, 4);     // bytes per second
+    put_le(header+32, 1, 2);            // bytes per sample
+    put_le(header+34, 8, 2);            // bits per sample
+    memcpy(header+36, "data", 4);
+    put_le(header+40, samples, 4);
+    fwrite(header, 1, sizeof(header), out);
+}
+
+/* Writes level until the wave reaches micros after the last half cycle */
+static void write_level(FILE *out, int micros, uint8_t level) {
+    out_micros += micros;
+    uint32_t end = out_micros * WAV_RATE / 1000000;
+    while (out_samples < end) {
+        if (out_len == sizeof(out_buffer)) {
+            fwrite(out_buffer, 1, out_len, out);
+            out_len = 0;
+        }
+        out_buffer[out_len++] = level;
+        out_samples++;
+    }
+}
+
+static void write_half(FILE *out, int micros) {
+    out_level = (out_level == 0x40) ? 0xc0 : 0x40;
+    write_level(out, micros, out_level);
+}
+
+void wav_write_start(FILE *out) {
+    out_len = 0;
+    out_samples = 0;
+    out_micros = 0;
+    out_level = 0x40;
+    // The sizes are filled in by wav_write_finish
+    write_header(out, 0);
+}
+
+void wav_write_record(FILE *out, uint8_t *data, int len) {
+    for (int i=0; i < LEADER_MICROS / LONG_HALF; i++) {
+        write_half(out, LONG_HALF);
+    }
+    write_half(out, SYNC_HALF);
+    write_half(out, SHORT_HALF);
+    for (int i=0; i < len; i++) {
+        for (int bit=0x80; bit != 0; bit >>= 1) {
+            int half = (data[i] & bit) ? LONG_HALF : SHORT_HALF;
+            write_half(out, half);
+            write_half(out, half);
+        }
+    }
+    // End the last half cycle before the silence
+    write_half(out, SHORT_HALF);
+    write_level(out, SILENCE_MICROS, 0x80);
+}
+
+void wav_write_finish(FILE *out) {
+    fwrite(out_buffer, 1, out_len, out);
+    out_len = 0;
+    if (out_samples & 1) {
+        fputc(0x80, out);   // RIFF chunks are padded to an even size
+    }
+    fseek(out, 0, SEEK_SET);
+    write_header(out, out_samples);
+}
+
+/* Reader state */
+static int16_t *in_samples;
+static int in_buffer_size;
+static int in_len;
+static int in_pos;
+static uint32_t in_rate;
+static int in_bytes_per_sample;
+static int in_channels;
+static uint32_t in_data_left;   // bytes of sample data not read yet
+static bool in_high;
+static uint32_t in_run;         // samples since the last crossing
+
+/* Reads the next block of samples, keeping only the first channel */
+static bool read_samples(FILE *in) {
+    static uint8_t raw[65536];
+    int frame = in_bytes_per_sample * in_channels;
+    uint32_t want = sizeof(raw) / frame * frame;
+
+    if (want > in_data_left) {
+        want = in_data_left;
+    }
+    int got = fread(raw, 1, want, in) / frame;
+    in_data_left -= want;
+    if (got == 0) {
+        in_data_left = 0;
+        return false;
+    }
+    if (got > in_buffer_size) {
+        in_buffer_size = got;
+        in_samples = realloc(in_samples, got * sizeof(int16_t));
+    }
+    if (in_bytes_per_sample == 1) {
+        for (int i=0; i < got; i++) {
+            in_samples[i] = (raw[i * frame] - 128) * 256;
+        }
+    } else {
+        for (int i=0; i < got; i++) {
+            in_samples[i] = (int16_t) (raw[i * frame] | (raw[i * frame + 1] << 8));
+        }
+    }
+    in_len = got;
+    in_pos = 0;
+    return true;
+}
+
+/* Returns the length in microseconds of the next half cycle, or -1 at
+ * the end of the file. A long silence comes back as a long half cycle. */
+static int next_half(FILE *in) {
+    uint32_t gap_samples = (uint64_t) GAP_MIN * in_rate / 1000000;
+
+    for (;;) {
+        if ((in_pos == in_len) && !read_samples(in)) {
+            if (in_run > 0) {
+                // Let the last half cycle end at the end of the file
+                int micros = (uint64_t) in_run * 1000000 / in_rate;
+                in_run = 0;
+                return micros;
+            }
+            return -1;
+        }
+        int16_t *samples = in_samples;
+        int pos = in_pos;
+        int len = in_len;
+
+        // Skip ahead to the next sample on the other side of zero
+        if (in_high) {
+            while ((pos < len) && (samples[pos] > -HYSTERESIS)) pos++;
+        } else {
+            while ((pos < len) && (samples[pos] < HYSTERESIS)) pos++;
+        }
+        in_run += pos - in_pos;
+        in_pos = pos;
+        if (pos < len) {
+            in_high = !in_high;
+            int micros = (uint64_t) in_run * 1000000 / in_rate;
+            in_run = 0;
+            return micros;
+        }
+        if (in_run > gap_samples) {
+            // Report a silence without waiting for it to end
+            int micros = (uint64_t) in_run * 1000000 / in_rate;
+            in_run = 0;
+            return micros;
+        }
+    }
+}
+
+/* Reads the WAV header, leaving the file at the start of the samples.
+ * Returns false and prints an error if the file isn't a PCM WAV file. */
+bool wav_read_start(FILE *in) {
+    uint8_t header[12];
+    uint8_t chunk[8];
+    uint8_t fmt[16];
+    bool got_fmt = false;
+
+    if ((fread(header, 1, sizeof(header), in) != sizeof(header)) ||
+        memcmp(header, "RIFF", 4) || memcmp(header+8, "WAVE", 4)) {
+        fprintf(stderr, "Not a WAV file\n");
+        return false;
+    }
+    while (fread(chunk, 1, sizeof(chunk), in) == sizeof(chunk)) {
+        uint32_t size = get_le(chunk+4, 4);
+        if (!memcmp(chunk, "fmt ", 4) && (size >= sizeof(fmt))) {
+            if (fread(fmt, 1, sizeof(fmt), in) != sizeof(fmt)) break;
+            fseek(in, size - sizeof(fmt) + (size & 1), SEEK_CUR);
+            got_fmt = true;
+        } else if (!memcmp(chunk, "data", 4)) {
+            if (!got_fmt) break;
+            int format = get_le(fmt, 2);
+            int bits = get_le(fmt+14, 2);
+            in_channels = get_le(fmt+2, 2);
+            in_rate = get_le(fmt+4, 4);
+            if ((format != 1) || ((bits != 8) && (bits != 16)) ||
+                (in_channels < 1) || (in_rate == 0)) {
+                fprintf(stderr, "Only 8 and 16-bit PCM WAV files are supported\n");
+                return false;
+            }
+            in_bytes_per_sample = bits / 8;
+            in_data_left = size;
+            in_len = 0;
+            in_pos = 0;
+            in_run = 0;
+            in_high = false;
+            return true;
+        } else {
+            fseek(in, size + (size & 1), SEEK_CUR);
+        }
+    }
+    fprintf(stderr, "WAV file has no sample data\n");
+    return false;
+}
+
+/* Finds the next record and reads up to max_len bytes from it. Returns
+ * the number of bytes read, which is less than max_len if the record
+ * ended first, or -1 if there are no more records. */
+int wav_read_record(FILE *in, uint8_t *data, int max_len) {
+    int leader = 0;
+    int half;
+
+    // Wait for a run of leader followed by the sync half cycle
+    for (;;) {
+        if ((half = next_half(in)) < 0) {
+            return -1;
+        }
+        if ((half < SHORT_HALF_MAX) && (leader >= LEADER_MIN)) {
+            break;
+        } else if ((half >= SHORT_HALF_MAX) && (half < GAP_MIN)) {
+            leader++;
+        } else {
+            leader = 0;
+        }
+    }
+    // The second half of the sync bit
+    if (next_half(in) < 0) {
+        return 0;
+    }
+
+    int len = 0;
+    while (len < max_len) {
+        uint8_t byte = 0;
+        for (int bit=0; bit < 8; bit++) {
+            int first = next_half(in);
+            if ((first < 0) || (first >= GAP_MIN)) {
+                return len;
+            }
+            int second = next_half(in);
+            if ((second < 0) || (second >= GAP_MIN)) {
+                // The last half cycle of a recording runs into the silence
+                // after it, so go by the first half
+                second = first;
+            }
+            byte = (byte << 1) | ((first + second) >= ZERO_CYCLE_MAX);
+        }
+        data[len++] = byte;
+    }
+    return len;
+}
@@ -1,27 +1,35 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
-void print_row(FILE *out, int addr, unsigned char *row) {
-    fprintf(out, "%04X: %02X %02X %02X %02X %02X %02X %02X %02x\n",
-            addr, row[0], row[1], row[2], row[3], row[4],
-            row[5], row[6], row[7]);
-}
+void write_rom_rows(FILE *out, uint32_t addr, const uint8_t *data, size_t len, int width);
+void write_ihex_rows(FILE *out, uint32_t addr, const uint8_t *data, size_t len);
+
+uint8_t data[65536];
 
 int main(int argc, char *argv[]) {
     if (argc < 4) {
         printf("Please supply an input filename, an output filename, and a starting address\n");
+        printf("and optionally the number of bytes per row (default 8). Use - for stdin/stdout.\n");
+        printf("An output filename ending in .hex is written as Intel HEX.\n");
         exit(1);
     }
 
     FILE *in;
     FILE *out;
 
-    if ((in = fopen(argv[1], "rb")) == NULL) {
+    if (!strcmp(argv[1], "-")) {
+        in = stdin;
+    } else if ((in = fopen(argv[1], "rb")) == NULL) {
         fprintf(stderr, "Unable to open file %s\n", argv[1]);
         exit(1);
     }
 
-    if ((out = fopen(argv[2], "w")) == NULL) {
+    if (!strcmp(argv[2], "-")) {
+        out = stdout;
+    } else if ((out = fopen(argv[2], "w")) == NULL) {
         fprintf(stderr, "Unable to open file %s\n", argv[2]);
         exit(1);
     }
@@ -30,29 +38,33 @@ int main(int argc, char *argv[]) {
 
     sscanf(argv[3], "%x", &addr);
 
-    if ((addr < 0) || (addr > 0xff80)) {
+    if ((addr < 0) || (addr > 0xffff)) {
         fprintf(stderr, "Address %x is out of range\n", addr);
         exit(1);
     }
 
-    unsigned char row[8];
-    unsigned char ch;
-    int row_pos = 0;
-
-    while (fread(&ch, 1, 1, in) == 1) {
-        row[row_pos++] = ch;
-        if (row_pos == 8) {
-            if (addr > 0xff80) {
-                fprintf(stderr, "Address %04x is out of range\n", addr);
-                exit(1);
-            }
-            print_row(out, addr, row);
-            row_pos = 0;
-            addr += 8;
+    int width = 8;
+    if (argc > 4) {
+        width = atoi(argv[4]);
+        if ((width < 1) || (width > 255)) {
+            fprintf(stderr, "Bytes per row must be from 1 to 255\n");
+            exit(1);
         }
     }
-    if (row_pos > 0) {
-        print_row(out, addr, row);
+
+    // Anything that would go past FFFF is an error, so 64K is the most
+    // that can be read
+    size_t len = fread(data, 1, 65536 - addr, in);
+    if (fgetc(in) != EOF) {
+        fprintf(stderr, "Input goes past address FFFF\n");
+        exit(1);
+    }
+
+    int name_len = strlen(argv[2]);
+    if ((name_len > 4) && !strcasecmp(argv[2] + name_len - 4, ".hex")) {
+        write_ihex_rows(out, addr, data, len);
+    } else {
+        write_rom_rows(out, addr, data, len, width);
     }
     fclose(in);
     fclose(out);
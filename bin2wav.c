@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+void wav_write_start(FILE *out);
+void wav_write_record(FILE *out, uint8_t *data, int len);
+void wav_write_finish(FILE *out);
+
+uint8_t data[65536];
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Please supply an output WAV file and one or more binary files\n");
+        printf("Each binary file is written as a separate cassette record\n");
+        exit(1);
+    }
+
+    FILE *out;
+
+    if ((out = fopen(argv[1], "wb")) == NULL) {
+        fprintf(stderr, "Unable to open file %s\n", argv[1]);
+        exit(1);
+    }
+
+    wav_write_start(out);
+    for (int i=2; i < argc; i++) {
+        FILE *in;
+
+        if ((in = fopen(argv[i], "rb")) == NULL) {
+            fprintf(stderr, "Unable to open file %s\n", argv[i]);
+            exit(1);
+        }
+        int len = fread(data, 1, sizeof(data), in);
+        if (fgetc(in) != EOF) {
+            fprintf(stderr, "File %s is bigger than 64K\n", argv[i]);
+            exit(1);
+        }
+        fclose(in);
+        wav_write_record(out, data, len);
+    }
+    wav_write_finish(out);
+    fclose(out);
+}
@@ -0,0 +1,138 @@
+/* Coverage of which addresses have been executed, read and written.
+ *
+ * Each kind of access has a bitmap with a bit per address (8K each), set
+ * by froot1 as the CPU runs. A coverage file is a header followed by the
+ * three bitmaps:
+ *   header - "F1CV", version (2 bytes, low first), 2 reserved bytes
+ * Runs can be combined by ORing the bitmaps, which is what -coverage does
+ * with a file that is already there, and what covmerge does with several.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define COVER_EXEC 0
+#define COVER_READ 1
+#define COVER_WRITE 2
+#define COVER_MAPS 3
+#define COVER_MAP_SIZE 8192
+
+#define COVERAGE_MAGIC "F1CV"
+#define COVERAGE_VERSION 1
+#define COVERAGE_HEADER_SIZE 8
+
+bool coverage_enabled = false;
+uint8_t coverage[COVER_MAPS][COVER_MAP_SIZE];
+
+static char *coverage_file_name = NULL;
+
+bool covered(int map, uint16_t addr) {
+    return coverage[map][addr >> 3] & (1 << (addr & 7));
+}
+
+int count_covered(int map) {
+    int count = 0;
+    for (int i=0; i < COVER_MAP_SIZE; i++) {
+        count += __builtin_popcount(coverage[map][i]);
+    }
+    return count;
+}
+
+/* ORs a coverage file into the bitmaps. Returns 0 if it can't be read,
+ * printing an error unless it just doesn't exist and quiet is set. */
+int merge_coverage(char *filename, bool quiet) {
+    static uint8_t data[COVER_MAPS][COVER_MAP_SIZE];
+    uint8_t header[COVERAGE_HEADER_SIZE];
+    FILE *in;
+
+    if ((in = fopen(filename, "rb")) == NULL) {
+        if (!quiet) fprintf(stderr, "Can't open file %s\n", filename);
+        return 0;
+    }
+    bool ok = (fread(header, 1, sizeof(header), in) == sizeof(header)) &&
+        !memcmp(header, COVERAGE_MAGIC, 4) &&
+        (fread(data, 1, sizeof(data), in) == sizeof(data));
+    fclose(in);
+    if (!ok) {
+        fprintf(stderr, "%s is not a coverage file\n", filename);
+        return 0;
+    }
+    if ((header[4] | (header[5] << 8)) != COVERAGE_VERSION) {
+        fprintf(stderr, "%s is an unsupported coverage version %d\n", filename,
+            header[4] | (header[5] << 8));
+        return 0;
+    }
+    for (int map=0; map < COVER_MAPS; map++) {
+        for (int i=0; i < COVER_MAP_SIZE; i++) {
+            coverage[map][i] |= data[map][i];
+        }
+    }
+    return 1;
+}
+
+int save_coverage(char *filename) {
+    uint8_t header[COVERAGE_HEADER_SIZE] = { 'F', '1', 'C', 'V',
+        COVERAGE_VERSION & 0xff, COVERAGE_VERSION >> 8, 0, 0 };
+    FILE *out;
+
+    if ((out = fopen(filename, "wb")) == NULL) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        return 0;
+    }
+    bool ok = (fwrite(header, 1, sizeof(header), out) == sizeof(header)) &&
+        (fwrite(coverage, 1, sizeof(coverage), out) == sizeof(coverage));
+    if ((fclose(out) != 0) || !ok) {
+        fprintf(stderr, "Unable to write %s\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+void print_coverage_summary(char *filename) {
+    printf("%s: %d bytes executed, %d read, %d written\n", filename,
+        count_covered(COVER_EXEC), count_covered(COVER_READ), count_covered(COVER_WRITE));
+}
+
+static void save_coverage_at_exit() {
+    if (save_coverage(coverage_file_name)) {
+        print_coverage_summary(coverage_file_name);
+    }
+}
+
+/* Turns on coverage for -coverage, adding to the file if it is already
+ * there, and saving it when the emulator exits */
+int start_coverage(char *filename) {
+    FILE *in;
+
+    if ((in = fopen(filename, "rb")) != NULL) {
+        fclose(in);
+        if (!merge_coverage(filename, false)) {
+            return 0;
+        }
+    }
+    coverage_file_name = filename;
+    coverage_enabled = true;
+    atexit(save_coverage_at_exit);
+    return 1;
+}
+
+/* Returns flags for the bytes at addr to addr+len-1, x if any of them
+ * were executed, r if read and w if written, otherwise - */
+const char *coverage_flags(uint16_t addr, int len) {
+    static char flags[4];
+    const char *letters = "xrw";
+
+    for (int map=0; map < COVER_MAPS; map++) {
+        flags[map] = '-';
+        for (int i=0; i < len; i++) {
+            if (covered(map, addr + i)) {
+                flags[map] = letters[map];
+                break;
+            }
+        }
+    }
+    flags[COVER_MAPS] = 0;
+    return flags;
+}
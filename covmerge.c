@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+int merge_coverage(char *filename, bool quiet);
+int save_coverage(char *filename);
+void print_coverage_summary(char *filename);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Please supply an output coverage file and one or more coverage files\n");
+        printf("The output covers every address covered by any of the inputs\n");
+        exit(1);
+    }
+
+    for (int i=2; i < argc; i++) {
+        if (!merge_coverage(argv[i], false)) {
+            exit(1);
+        }
+    }
+    if (!save_coverage(argv[1])) {
+        exit(1);
+    }
+    print_coverage_summary(argv[1]);
+    return 0;
+}
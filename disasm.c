@@ -0,0 +1,451 @@
+/* 6502 disassembler for the debugger and for dumping memory to a file.
+ *
+ * Instructions are formatted straight into a text buffer with lookup
+ * tables for the hex, and the buffer is written out in large blocks, so
+ * dumping all 64K takes no time. Operands that point at or just past a
+ * loaded symbol are labelled with it, and symbols at an instruction are
+ * shown as a label line before it.
+ *
+ * A dump first classifies memory into code and data by following the
+ * code from the reset and interrupt vectors (and any other entry points
+ * given), through jumps, branches and subroutine calls. Everything that
+ * isn't reached is written as data.
+ *
+ * With -coverage, each line also shows whether its bytes were executed,
+ * read or written (xrw, with - for no).
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern uint8_t ram[65536];
+
+const char *symbol_at(uint16_t, uint16_t, uint16_t *);
+const char *coverage_flags(uint16_t, int);
+extern bool coverage_enabled;
+
+#define BLOCK_SIZE 65536
+#define MAX_LINE 256
+#define LABEL_MAX_OFFSET 0x100
+#define DATA_ROW_WIDTH 8
+#define MIN_FILL_RUN 32     // runs of the same data byte this long become .res
+
+enum addressing_modes {
+    IMM, ABS, ABS_X, ABS_Y, ZP, ZP_X, ZP_Y, IND, IND_X, IND_Y, REL, ACC, NONE
+};
+
+struct instruction {
+    char *opcode;
+    uint16_t addr_mode;
+};
+
+#define ILLEGAL { "???", NONE }
+
+static const struct instruction instruction_desc[] = {
+/* 0 */    { "brk", NONE }, {"ora", IND_X}, ILLEGAL, ILLEGAL, ILLEGAL, {"ora", ZP}, {"asl", ZP}, ILLEGAL, {"php", NONE}, {"ora", IMM}, {"asl", ACC}, ILLEGAL, ILLEGAL, {"ora", ABS}, {"asl", ABS}, ILLEGAL,
+/* 1 */    { "bpl", REL}, {"ora", IND_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"ora", ZP_X}, {"asl", ZP_X}, ILLEGAL, {"clc", NONE}, {"ora", ABS_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"ora", ABS_X}, {"asl", ABS_X}, ILLEGAL,
+/* 2 */    { "jsr", ABS}, {"and", IND_X}, ILLEGAL, ILLEGAL, {"bit", ZP}, {"and", ZP}, {"rol", ZP}, ILLEGAL, {"plp", NONE}, {"and", IMM}, {"rol", ACC}, ILLEGAL, {"bit", ABS}, {"and", ABS}, {"rol", ABS}, ILLEGAL,
+/* 3 */    { "bmi", REL}, {"and", IND_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"and", ZP_X}, {"rol", ZP_X}, ILLEGAL, {"sec", NONE}, {"and",ABS_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"and", ABS_X}, {"rol", ABS_X}, ILLEGAL,
+/* 4 */    { "rti", NONE}, {"eor", IND_X}, ILLEGAL, ILLEGAL, ILLEGAL, {"eor", ZP}, {"lsr", ZP}, ILLEGAL, {"pha", NONE}, {"eor", IMM}, {"lsr", ACC}, ILLEGAL, {"jmp", ABS}, {"eor", ABS}, {"lsr", ABS}, ILLEGAL,
+/* 5 */    { "bvc", REL}, {"eor", IND_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"eor", ZP_X}, {"lsr", ZP_X}, ILLEGAL, {"cli", NONE}, {"eor", ABS_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"eor", ABS_X}, {"lsr", ABS_X}, ILLEGAL,
+/* 6 */    {"rts", NONE}, {"adc", IND_X}, ILLEGAL, ILLEGAL, ILLEGAL, {"adc", ZP}, {"ror", ZP}, ILLEGAL, {"pla", NONE}, {"adc", IMM}, {"ror", ACC}, ILLEGAL, {"jmp",IND}, {"adc", ABS}, {"ror", ABS}, ILLEGAL,
+/* 7 */    {"bvs", REL}, {"adc",IND_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"adc",ZP_X}, {"ror", ZP_X}, ILLEGAL, {"sei", NONE}, {"adc", ABS_Y},ILLEGAL, ILLEGAL, ILLEGAL, {"adc",ABS_X}, {"ror",ABS_X}, ILLEGAL,
+/* 8 */     ILLEGAL, {"sta",IND_X}, ILLEGAL, ILLEGAL, {"sty",ZP}, {"sta",ZP}, {"stx",ZP}, ILLEGAL, {"dey",NONE}, ILLEGAL,{"txa", NONE}, ILLEGAL, {"sty",ABS},{"sta",ABS},{"stx",ABS}, ILLEGAL,
+/* 9 */     {"bcc", REL}, {"sta", IND_Y}, ILLEGAL, ILLEGAL, {"sty",ZP_X}, {"sta",ZP_X}, {"stx",ZP_Y}, ILLEGAL, {"tya", NONE}, {"sta",ABS_Y}, {"txs",NONE},  ILLEGAL, ILLEGAL, {"sta",ABS_X}, ILLEGAL, ILLEGAL,
+/* a */     {"ldy",IMM}, {"lda",IND_X},{"ldx",IMM}, ILLEGAL,{"ldy",ZP},{"lda",ZP},{"ldx",ZP}, ILLEGAL, {"tay", NONE}, {"lda", IMM}, {"tax", NONE},  ILLEGAL, {"ldy",ABS}, {"lda",ABS}, {"ldx",ABS},  ILLEGAL,
+/* b */     {"bcs",REL},{"lda",IND_Y}, ILLEGAL, ILLEGAL,{"ldy",ZP_X},{"lda",ZP_X},{"ldx",ZP_Y}, ILLEGAL,{"clv",NONE},{"lda",ABS_Y},{"tsx",NONE}, ILLEGAL,{"ldy",ABS_X},{"lda",ABS_X},{"ldx",ABS_Y}, ILLEGAL,
+/* c */     {"cpy",IMM},{"cmp",IND_X}, ILLEGAL, ILLEGAL,{"cpy",ZP},{"cmp",ZP},{"dec",ZP}, ILLEGAL, {"iny",NONE},{"cmp",IMM},{"dex",NONE}, ILLEGAL,{"cpy",ABS},{"cmp",ABS},{"dec",ABS},ILLEGAL,
+/* d */     {"bne",REL},{"cmp",IND_Y},ILLEGAL, ILLEGAL, ILLEGAL,{"cmp",ZP_X},{"dec",ZP_X}, ILLEGAL,{"cld",NONE},{"cmp",ABS_Y},ILLEGAL, ILLEGAL, ILLEGAL, {"cmp",ABS_X},{"dec",ABS_X}, ILLEGAL,
+/* e */     {"cpx",IMM},{"sbc",IND_X}, ILLEGAL, ILLEGAL,{"cpx",ZP},{"sbc",ZP},{"inc",ZP}, ILLEGAL,{"inx",NONE},{"sbc",IMM},{"nop",NONE}, ILLEGAL,{"cpx",ABS},{"sbc",ABS},{"inc",ABS}, ILLEGAL,
+/* f */     {"beq",REL},{"sbc",IND_Y},ILLEGAL, ILLEGAL, ILLEGAL,{"sbc",ZP_X},{"inc",ZP_X}, ILLEGAL,{"sed",NONE},{"sbc",ABS_Y},ILLEGAL, ILLEGAL, ILLEGAL,{"sbc",ABS_X},{"inc",ABS_X}, ILLEGAL
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+uint16_t instruction_size(uint8_t addr_mode) {
+    switch (addr_mode) {
+        case ABS:
+        case ABS_X:
+        case ABS_Y:
+        case IND:
+            return 3;
+        case ZP:
+        case ZP_X:
+        case ZP_Y:
+        case IND_X:
+        case IND_Y:
+        case IMM:
+        case REL:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+uint16_t next_inst_addr(uint16_t loc) {
+    uint8_t opcode = ram[loc];
+    struct instruction inst = instruction_desc[opcode];
+    uint8_t addr_mode = inst.addr_mode;
+    return loc + instruction_size(addr_mode);
+}
+
+static char *put_hex2(char *p, uint8_t value) {
+    *p++ = hex_digits[value >> 4];
+    *p++ = hex_digits[value & 15];
+    return p;
+}
+
+static char *put_hex4(char *p, uint16_t value) {
+    p = put_hex2(p, value >> 8);
+    return put_hex2(p, value & 0xff);
+}
+
+static char *put_str(char *p, const char *str) {
+    while (*str) *p++ = *str++;
+    return p;
+}
+
+/* Adds a symbol for addr, if there is one close enough */
+static char *put_symbol(char *p, char *end, uint16_t addr) {
+    uint16_t offset;
+    const char *name = symbol_at(addr, LABEL_MAX_OFFSET, &offset);
+
+    if (name == NULL) {
+        return p;
+    }
+    int len = snprintf(p, end - p, offset ? " <%s+%x>" : " <%s>", name, offset);
+    return p + ((len < end - p) ? len : end - p - 1);
+}
+
+/* Formats the instruction at addr into text (without a newline) and
+ * returns its size in bytes */
+int format_instruction(uint16_t addr, char *text, int size) {
+    char *p = text;
+    char *end = text + size;
+    struct instruction inst = instruction_desc[ram[addr]];
+    int inst_size = instruction_size(inst.addr_mode);
+    uint16_t operand = ram[(uint16_t) (addr+1)];
+    if (inst_size == 3) {
+        operand |= ram[(uint16_t) (addr+2)] << 8;
+    }
+
+    p = put_hex4(p, addr);
+    *p++ = ':';
+    *p++ = ' ';
+    if (coverage_enabled) {
+        p = put_str(p, coverage_flags(addr, inst_size));
+        *p++ = ' ';
+    }
+    for (int i=0; i < 3; i++) {
+        if (i < inst_size) {
+            p = put_hex2(p, ram[(uint16_t) (addr+i)]);
+            *p++ = ' ';
+        } else {
+            p = put_str(p, "   ");
+        }
+    }
+    *p++ = ' ';
+    p = put_str(p, inst.opcode);
+
+    switch (inst.addr_mode) {
+        case IMM:
+            p = put_str(p, " #$");
+            p = put_hex2(p, operand);
+            break;
+        case ZP:
+        case ZP_X:
+        case ZP_Y:
+            p = put_str(p, " $");
+            p = put_hex2(p, operand);
+            p = put_str(p, (inst.addr_mode == ZP_X) ? ",X" : (inst.addr_mode == ZP_Y) ? ",Y" : "");
+            break;
+        case IND_X:
+            p = put_str(p, " ($");
+            p = put_hex2(p, operand);
+            p = put_str(p, ",X)");
+            break;
+        case IND_Y:
+            p = put_str(p, " ($");
+            p = put_hex2(p, operand);
+            p = put_str(p, "),Y");
+            break;
+        case ABS:
+        case ABS_X:
+        case ABS_Y:
+            p = put_str(p, " $");
+            p = put_hex4(p, operand);
+            p = put_str(p, (inst.addr_mode == ABS_X) ? ",X" : (inst.addr_mode == ABS_Y) ? ",Y" : "");
+            p = put_symbol(p, end, operand);
+            break;
+        case IND:
+            p = put_str(p, " ($");
+            p = put_hex4(p, operand);
+            *p++ = ')';
+            p = put_symbol(p, end, operand);
+            break;
+        case REL:
+            operand = addr + 2 + (int8_t) operand;
+            p = put_str(p, " $");
+            p = put_hex4(p, operand);
+            p = put_symbol(p, end, operand);
+            break;
+        case ACC:
+            p = put_str(p, " A");
+            break;
+    }
+    *p = 0;
+    return inst_size;
+}
+
+/* Adds a label line if a symbol is exactly at addr */
+static char *put_label(char *p, uint16_t addr) {
+    uint16_t offset;
+    const char *name = symbol_at(addr, 0, &offset);
+
+    if (name != NULL) {
+        int len = snprintf(p, MAX_LINE, "%s:\n", name);
+        p += (len < MAX_LINE) ? len : MAX_LINE - 1;
+    }
+    return p;
+}
+
+void disassemble(uint16_t from, uint16_t to) {
+    static char buffer[BLOCK_SIZE + 2 * MAX_LINE];
+    char *p = buffer;
+
+    while (from < to) {
+        p = put_label(p, from);
+        uint16_t size = format_instruction(from, p, MAX_LINE);
+        p += strlen(p);
+        *p++ = '\n';
+        if (p - buffer >= BLOCK_SIZE) {
+            fwrite(buffer, 1, p - buffer, stdout);
+            p = buffer;
+        }
+        if (from + size < from) {
+            break;      // wrapped around past ffff
+        }
+        from += size;
+    }
+    fwrite(buffer, 1, p - buffer, stdout);
+}
+
+/* Marks the bytes of every instruction that can be reached from entries
+ * in is_code, using a work list instead of recursion */
+static void classify_code(uint16_t *entries, int entry_count, bool *is_code) {
+    static bool is_start[65536];
+    static uint16_t work[65536];
+    int work_count = 0;
+
+    memset(is_start, 0, sizeof(is_start));
+    memset(is_code, 0, 65536);
+    for (int i=0; i < entry_count; i++) {
+        work[work_count++] = entries[i];
+    }
+
+    while (work_count > 0) {
+        uint32_t addr = work[--work_count];
+        for (;;) {
+            if (is_start[addr] || is_code[addr]) {
+                break;      // already followed, or inside another instruction
+            }
+            struct instruction inst = instruction_desc[ram[addr]];
+            if (inst.opcode[0] == '?') {
+                break;
+            }
+            int size = instruction_size(inst.addr_mode);
+            if (addr + size > 65536) {
+                break;
+            }
+            is_start[addr] = true;
+            memset(&is_code[addr], true, size);
+
+            uint16_t target = ram[(addr+1) & 0xffff] | (ram[(addr+2) & 0xffff] << 8);
+            if (inst.addr_mode == REL) {
+                target = addr + 2 + (int8_t) ram[addr+1];
+            }
+            bool is_jmp = !strcmp(inst.opcode, "jmp");
+            if ((inst.addr_mode == REL) || !strcmp(inst.opcode, "jsr") ||
+                (is_jmp && (inst.addr_mode == ABS))) {
+                if (!is_start[target] && (work_count < 65536)) {
+                    work[work_count++] = target;
+                }
+            }
+            if (is_jmp || !strcmp(inst.opcode, "rts") || !strcmp(inst.opcode, "rti") ||
+                !strcmp(inst.opcode, "brk")) {
+                break;
+            }
+            addr += size;
+        }
+    }
+}
+
+/* Formats a run of data bytes from addr up to end (exclusive) */
+static char *put_data(char *p, uint16_t addr, uint32_t end) {
+    int count = (end - addr < DATA_ROW_WIDTH) ? end - addr : DATA_ROW_WIDTH;
+
+    p = put_hex4(p, addr);
+    p = put_str(p, ": ");
+    if (coverage_enabled) {
+        p = put_str(p, coverage_flags(addr, count));
+        *p++ = ' ';
+    }
+    p = put_str(p, "         .byte ");
+    for (int i=0; i < count; i++) {
+        if (i > 0) *p++ = ',';
+        *p++ = '$';
+        p = put_hex2(p, ram[addr+i]);
+    }
+    *p++ = '\n';
+    return p;
+}
+
+/* Writes a disassembly of start-end to filename, with code found by
+ * following the vectors and entries, and everything else as data */
+int write_disassembly(char *filename, uint16_t start, uint16_t end,
+        uint16_t *entries, int entry_count) {
+    static char buffer[BLOCK_SIZE + 2 * MAX_LINE];
+    static bool is_code[65536];
+    static uint16_t all_entries[256];
+    char *p = buffer;
+    FILE *out;
+
+    if ((out = fopen(filename, "w")) == NULL) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        return 0;
+    }
+
+    int count = 0;
+    for (uint16_t vector=0xfffa; vector >= 0xfffa; vector += 2) {
+        uint16_t target = ram[vector] | (ram[vector+1] << 8);
+        // A vector that was never set up doesn't point at code
+        if ((target != 0x0000) && (target != 0xffff)) {
+            all_entries[count++] = target;
+        }
+    }
+    for (int i=0; (i < entry_count) && (count < 256); i++) {
+        all_entries[count++] = entries[i];
+    }
+    classify_code(all_entries, count, is_code);
+
+    int code_bytes = 0;
+    uint32_t addr = start;
+    while (addr <= end) {
+        p = put_label(p, addr);
+        if (is_code[addr]) {
+            int size = format_instruction(addr, p, MAX_LINE);
+            p += strlen(p);
+            *p++ = '\n';
+            code_bytes += size;
+            addr += size;
+        } else {
+            // Data runs up to the next code byte or symbol
+            uint32_t data_end = addr + 1;
+            uint16_t offset;
+            while ((data_end <= end) && !is_code[data_end] &&
+                   (symbol_at(data_end, 0, &offset) == NULL)) {
+                data_end++;
+            }
+            while (addr < data_end) {
+                uint32_t run = addr + 1;
+                while ((run < data_end) && (ram[run] == ram[addr])) run++;
+                if (run - addr >= MIN_FILL_RUN) {
+                    p = put_hex4(p, addr);
+                    p = put_str(p, ": ");
+                    if (coverage_enabled) {
+                        p = put_str(p, coverage_flags(addr, run - addr));
+                        *p++ = ' ';
+                    }
+                    p = put_str(p, "         .res $");
+                    p = put_hex4(p, run - addr);
+                    p = put_str(p, ",$");
+                    p = put_hex2(p, ram[addr]);
+                    *p++ = '\n';
+                    addr = run;
+                } else {
+                    // Stop a row before a run long enough to be a .res
+                    uint32_t row_end = addr;
+                    while ((row_end < data_end) && (row_end < addr + DATA_ROW_WIDTH)) {
+                        uint32_t same = row_end + 1;
+                        while ((same < data_end) && (ram[same] == ram[row_end])) same++;
+                        if ((same - row_end >= MIN_FILL_RUN) && (row_end > addr)) break;
+                        row_end++;
+                    }
+                    p = put_data(p, addr, row_end);
+                    addr = row_end;
+                }
+                if (p - buffer >= BLOCK_SIZE) {
+                    fwrite(buffer, 1, p - buffer, out);
+                    p = buffer;
+                }
+            }
+        }
+        if (p - buffer >= BLOCK_SIZE) {
+            fwrite(buffer, 1, p - buffer, out);
+            p = buffer;
+        }
+    }
+    fwrite(buffer, 1, p - buffer, out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Unable to write %s\n", filename);
+        return 0;
+    }
+    printf("Disassembled %04x-%04x to %s, %d bytes of code\n", start, end, filename, code_bytes);
+    return 1;
+}
+
+/* Lists the instructions in start-end that use target as an operand or
+ * branch to it. Every address is decoded as a possible instruction, so
+ * nothing is missed even where code and data are mixed. */
+int find_references(uint16_t target, uint16_t start, uint16_t end) {
+    char line[MAX_LINE];
+    int found = 0;
+
+    for (uint32_t addr=start; addr <= end; addr++) {
+        struct instruction inst = instruction_desc[ram[addr]];
+        if ((inst.opcode[0] == '?') || (addr + instruction_size(inst.addr_mode) > 65536)) {
+            continue;
+        }
+        uint16_t operand = ram[(addr+1) & 0xffff];
+        bool uses = false;
+        switch (inst.addr_mode) {
+            case ABS:
+            case ABS_X:
+            case ABS_Y:
+            case IND:
+                uses = (operand | (ram[addr+2] << 8)) == target;
+                break;
+            case ZP:
+            case ZP_X:
+            case ZP_Y:
+            case IND_X:
+            case IND_Y:
+                uses = operand == target;
+                break;
+            case REL:
+                uses = (uint16_t) (addr + 2 + (int8_t) operand) == target;
+                break;
+        }
+        if (uses) {
+            format_instruction(addr, line, sizeof(line));
+            printf("%s\n", line);
+            found++;
+        }
+    }
+    return found;
+}
+
+/* Names for the statistics report */
+const char *opcode_name(uint8_t opcode) {
+    return instruction_desc[opcode].opcode;
+}
+
+const char *opcode_mode_name(uint8_t opcode) {
+    static const char *mode_names[] = {
+        "#imm", "abs", "abs,X", "abs,Y", "zp", "zp,X", "zp,Y", "(ind)", "(zp,X)", "(zp),Y",
+        "rel", "A", "implied"
+    };
+    return mode_names[instruction_desc[opcode].addr_mode];
+}
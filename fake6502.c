@@ -89,17 +89,39 @@
  *     that function once after each emulated        *
  *     instruction.                                  *
  *                                                   *
+ * void hookstackwrap(void *funcptr)                 *
+ *   - Pass a pointer to a void function taking a    *
+ *     uint8_t, called with 1 when a push wraps the  *
+ *     stack pointer below 00 and 0 when a pull      *
+ *     wraps it above FF.                            *
+ *                                                   *
  *****************************************************
  * Useful variables in this emulator:                *
  *                                                   *
  * uint32_t clockticks6502                           *
  *   - A running total of the emulated cycle count.  *
  *                                                   *
- * uint32_t instructions                             *
+ * uint64_t instructions                             *
  *   - A running total of the total emulated         *
  *     instruction count. This is not related to     *
  *     clock cycle timing.                           *
  *                                                   *
+ * uint8_t stacklow6502, uint16_t stacklowpc6502     *
+ *   - The lowest the stack pointer has been, and    *
+ *     the pc of the instruction that pushed it.     *
+ *                                                   *
+ * uint16_t calldepth6502[65536]                     *
+ *   - The deepest stack (in bytes, return address   *
+ *     included) that each JSR target was called at. *
+ *                                                   *
+ * uint8_t statsenabled6502                          *
+ *   - Set to count each opcode's executions,        *
+ *     cycles, indexed page crossings, extra cycles  *
+ *     from them, and taken branches (and those that *
+ *     crossed a page) in the uint64_t arrays        *
+ *     opcount6502, opcycles6502, pagecross6502,     *
+ *     penalty6502, branchtaken6502, branchpage6502. *
+ *                                                   *
  *****************************************************/
 
 #include <stdio.h>
@@ -171,11 +193,19 @@ uint8_t sp, a, x, y, status;
 
 
 //helper variables
-uint32_t instructions = 0; //keep track of total instructions executed
+uint64_t instructions = 0; //keep track of total instructions executed
 uint32_t clockticks6502 = 0, clockgoal6502 = 0;
 uint16_t oldpc, ea, reladdr, value, result;
 uint8_t opcode, oldstatus;
 
+//stack instrumentation
+uint8_t stacklow6502 = 0xFF;
+uint16_t stacklowpc6502 = 0;
+uint16_t calldepth6502[65536];
+uint16_t instpc6502; //address of the instruction being executed
+uint8_t callstackwrap = 0;
+void (*stackwrapexternal)(uint8_t);
+
 //externally supplied functions
 extern uint8_t read6502(uint16_t address);
 extern void write6502(uint16_t address, uint8_t value);
@@ -184,21 +214,34 @@ extern void write6502(uint16_t address, uint8_t value);
 void push16(uint16_t pushval) {
     write6502(BASE_STACK + sp, (pushval >> 8) & 0xFF);
     write6502(BASE_STACK + ((sp - 1) & 0xFF), pushval & 0xFF);
+    if ((sp < 2) && callstackwrap) (*stackwrapexternal)(1);
     sp -= 2;
+    if (sp < stacklow6502) {
+        stacklow6502 = sp;
+        stacklowpc6502 = instpc6502;
+    }
 }
 
 void push8(uint8_t pushval) {
-    write6502(BASE_STACK + sp--, pushval);
+    write6502(BASE_STACK + sp, pushval);
+    if ((sp == 0) && callstackwrap) (*stackwrapexternal)(1);
+    sp--;
+    if (sp < stacklow6502) {
+        stacklow6502 = sp;
+        stacklowpc6502 = instpc6502;
+    }
 }
 
 uint16_t pull16() {
     uint16_t temp16;
     temp16 = read6502(BASE_STACK + ((sp + 1) & 0xFF)) | ((uint16_t)read6502(BASE_STACK + ((sp + 2) & 0xFF)) << 8);
+    if ((sp >= 0xFE) && callstackwrap) (*stackwrapexternal)(0);
     sp += 2;
     return(temp16);
 }
 
 uint8_t pull8() {
+    if ((sp == 0xFF) && callstackwrap) (*stackwrapexternal)(0);
     return (read6502(BASE_STACK + ++sp));
 }
 
@@ -572,6 +615,7 @@ static void jmp() {
 
 static void jsr() {
     push16(pc - 1);
+    if (0xff - sp > calldepth6502[ea]) calldepth6502[ea] = 0xff - sp;
     pc = ea;
 }
 
@@ -923,10 +967,33 @@ void irq6502() {
 uint8_t callexternal = 0;
 void (*loopexternal)();
 
+//execution statistics, only kept while statsenabled6502 is set
+uint8_t statsenabled6502 = 0;
+uint64_t opcount6502[256], opcycles6502[256], pagecross6502[256], penalty6502[256];
+uint64_t branchtaken6502[256], branchpage6502[256];
+
+static void countstats(uint32_t cycles) {
+    opcount6502[opcode]++;
+    opcycles6502[opcode] += cycles;
+    if (penaltyaddr) pagecross6502[opcode]++;
+    //go by the cycles charged, the undocumented read-modify-write opcodes
+    //take the page crossing penalty back
+    uint32_t extra = cycles - ticktable[opcode];
+    if (addrtable[opcode] == rel) {
+        //a taken branch takes 1 extra cycle, 2 if it goes to another page
+        if (extra) branchtaken6502[opcode]++;
+        if (extra > 1) branchpage6502[opcode]++;
+    } else if (extra) {
+        penalty6502[opcode]++;
+    }
+}
+
 void exec6502(uint32_t tickcount) {
     clockgoal6502 += tickcount;
    
     while (clockticks6502 < clockgoal6502) {
+        uint32_t startticks = clockticks6502;
+        instpc6502 = pc;
         opcode = read6502(pc++);
         status |= FLAG_CONSTANT;
 
@@ -937,6 +1004,7 @@ void exec6502(uint32_t tickcount) {
         (*optable[opcode])();
         clockticks6502 += ticktable[opcode];
         if (penaltyop && penaltyaddr) clockticks6502++;
+        if (statsenabled6502) countstats(clockticks6502 - startticks);
 
         instructions++;
 
@@ -946,6 +1014,8 @@ void exec6502(uint32_t tickcount) {
 }
 
 void step6502() {
+    uint32_t startticks = clockticks6502;
+    instpc6502 = pc;
     opcode = read6502(pc++);
     status |= FLAG_CONSTANT;
 
@@ -957,12 +1027,20 @@ void step6502() {
     clockticks6502 += ticktable[opcode];
     if (penaltyop && penaltyaddr) clockticks6502++;
     clockgoal6502 = clockticks6502;
+    if (statsenabled6502) countstats(clockticks6502 - startticks);
 
     instructions++;
 
     if (callexternal) (*loopexternal)();
 }
 
+void hookstackwrap(void *funcptr) {
+    if (funcptr != (void *)NULL) {
+        stackwrapexternal = funcptr;
+        callstackwrap = 1;
+    } else callstackwrap = 0;
+}
+
 void hookexternal(void *funcptr) {
     if (funcptr != (void *)NULL) {
         loopexternal = funcptr;
@@ -6,8 +6,15 @@
 #include <stdbool.h>
 #include <time.h>
 #include <memory.h>
+#include <strings.h>
+#include <sys/select.h>
+#include <sys/mman.h>
 #include <ctype.h>
 #include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <signal.h>
 
 #define LF  0x0A
 #define CR  0x0D
@@ -18,9 +25,121 @@ uint8_t ram[65536];
 bool rom[65536];
 bool breakpoint[65536];
 bool cassette_enabled = true;
+bool rom_cache_enabled = true;
+
+// Coverage bitmaps, a bit per address for each kind of access
+#define COVER_EXEC 0
+#define COVER_READ 1
+#define COVER_WRITE 2
+#define COVER(map, addr) (coverage[map][(addr) >> 3] |= 1 << ((addr) & 7))
+extern bool coverage_enabled;
+extern uint8_t coverage[3][8192];
+
+// Access counts for -heatmap, they stop at the largest count instead of wrapping
+#define HEAT_EXEC 0
+#define HEAT_READ 1
+#define HEAT_WRITE 2
+#define HEAT(map, addr) (heat[map][addr] += (heat[map][addr] != UINT32_MAX))
+extern bool heatmap_enabled;
+extern uint32_t heat[3][65536];
+
+// The default ROMs are built in, generated into romdata.c by rom2c
+struct builtin_rom {
+    const char *name;
+    uint16_t addr;
+    uint32_t len;
+    const uint8_t *data;
+};
+extern const struct builtin_rom builtin_roms[];
+extern const int builtin_rom_count;
 
 FILE *cassette_file;
-FILE *input_file;
+// A cassette file ending in .wav holds real ACI audio instead of bytes
+bool cassette_wav = false;
+bool cassette_writing = false;
+
+// Block storage device, enabled with -disk. The guest sets up the block
+// number, memory address and block count and then writes a command, and
+// the blocks are copied between the disk image and memory at once.
+#define DISK_BASE 0xc400
+#define DISK_CMD 0      // write: 1=read, 2=write, 3=size into DISK_BLOCK
+#define DISK_STATUS 1   // 0=ok, 1=I/O error, 2=block out of range
+#define DISK_BLOCK 2    // 2 bytes, low first
+#define DISK_ADDR 4     // 2 bytes, low first
+#define DISK_COUNT 6    // blocks to transfer, 0 = 256
+#define DISK_REGS 8
+#define DISK_BLOCK_SIZE 256
+#define DISK_MAX_BLOCKS 65536
+
+#define DISK_READ 1
+#define DISK_WRITE 2
+#define DISK_SIZE 3
+
+#define DISK_OK 0
+#define DISK_IO_ERROR 1
+#define DISK_RANGE_ERROR 2
+
+char *disk_file_name = NULL;
+FILE *disk_file = NULL;
+uint8_t disk_regs[DISK_REGS];
+
+// Host call device, enabled with -hostcall. The guest fills in the
+// argument registers and writes a function number to HOSTCALL_CALL,
+// which runs the function natively before the next instruction.
+// Arguments and results are 32 bits, low byte first.
+#define HOSTCALL_BASE 0xc410
+#define HOSTCALL_CALL 0x00
+#define HOSTCALL_STATUS 0x01    // 0=ok, 1=unknown function, 2=divide by zero, 3=not found
+#define HOSTCALL_A 0x04
+#define HOSTCALL_B 0x08
+#define HOSTCALL_C 0x0c
+#define HOSTCALL_D 0x10
+#define HOSTCALL_RES1 0x14
+#define HOSTCALL_RES2 0x18
+#define HOSTCALL_REGS 0x1c
+
+#define HOSTCALL_MOVE 1     // copy C bytes from A to B, overlap is fine
+#define HOSTCALL_FILL 2     // fill C bytes at B with A
+#define HOSTCALL_MUL16 3    // RES1 = A * B, 16 bits each
+#define HOSTCALL_DIV16 4    // RES1 = A / B, RES2 = A % B, 16 bits each
+#define HOSTCALL_MUL32 5    // RES2:RES1 = A * B
+#define HOSTCALL_DIV32 6    // RES1 = A / B, RES2 = A % B
+#define HOSTCALL_COMPARE 7  // compare C bytes at A and B, RES1 = offset of
+                            // first difference (C if equal), RES2 = -1/0/1
+#define HOSTCALL_SEARCH 8   // find the D bytes at B in the C bytes at A,
+                            // RES1 = address of the match
+
+#define HOSTCALL_OK 0
+#define HOSTCALL_BAD_FUNCTION 1
+#define HOSTCALL_DIVIDE_BY_ZERO 2
+#define HOSTCALL_NOT_FOUND 3
+
+bool hostcall_enabled = false;
+
+// High-level emulation of the monitor's ECHO and key wait, off unless
+// -hle y is given, so every instruction and cycle is emulated by default
+bool hle_enabled = false;
+#define HLE_KEY_WAIT_MILLIS 10
+#define FLAG_ZERO 0x02
+#define FLAG_OVERFLOW 0x40
+#define FLAG_SIGN 0x80
+uint8_t hostcall_regs[HOSTCALL_REGS];
+
+// Stack checking, fake6502 tracks the depth and calls stack_wrapped
+bool stack_break = false;
+uint32_t stack_overflows = 0;
+uint32_t stack_underflows = 0;
+extern uint8_t stacklow6502;
+extern uint16_t stacklowpc6502;
+extern uint16_t instpc6502;
+extern uint16_t calldepth6502[65536];
+extern void hookstackwrap(void *);
+
+// Hooks run after the instruction that leaves pc at a hooked address.
+// hooked_page keeps the check for unhooked code to one small lookup.
+typedef void (*pc_hook_func)();
+pc_hook_func pc_hooks[65536];
+bool hooked_page[256];
 
 extern void reset6502();
 extern void exec6502(uint32_t);
@@ -31,25 +150,109 @@ extern volatile uint8_t a, x, y, sp, status;
 extern volatile uint32_t clockticks6502;
 
 int load_mem(char *filename, bool read_only);
+int load_builtin(char *filename, bool read_only);
+int hex_digit_value(char ch);
+int parse_rom_stream(FILE *in, char *name,
+        void (*row)(void *, uint32_t, const uint8_t *, int), void *context);
+int parse_binary_stream(FILE *in, char *name, uint32_t addr,
+        void (*row)(void *, uint32_t, const uint8_t *, int), void *context);
+uint8_t *map_file(int fd, size_t *len);
+uint64_t hash_bytes(const uint8_t *data, size_t len);
+bool is_image(const uint8_t *data, size_t len);
+int load_image(const uint8_t *data, size_t len, bool read_only, char *filename);
+int save_image(char *filename, uint16_t start, uint16_t end);
+bool load_cached_rom(uint64_t hash, bool read_only);
+void save_cached_rom(uint64_t hash, bool *loaded);
+bool is_wav_file(char *filename);
+void wav_write_start(FILE *out);
+void wav_write_record(FILE *out, uint8_t *data, int len);
+void wav_write_finish(FILE *out);
+bool wav_read_start(FILE *in);
+int wav_read_record(FILE *in, uint8_t *data, int max_len);
 int load_syms(char *filename);
+bool basic_loaded();
+int load_basic(char *filename);
+int list_basic(FILE *out);
+int save_basic(char *filename);
 int kbhit(bool);
 void reset_term();
+void handle_sigint(int);
+void quit_if_requested();
 long current_time_millis();
 void do_step();
-void check_pc();
-void handle_kb();
+void add_pc_hook(uint16_t, void (*)());
+void add_cassette_hooks();
+void add_hle_hooks();
+void stack_wrapped(uint8_t);
+void stack_report();
+bool open_disk(char *);
+void disk_command(uint8_t);
+void host_call(uint8_t);
+void output_char(char);
+void flush_output();
+void check_output_flush();
+bool output_full();
+void start_output_thread();
+void handle_kb(int);
+void handle_key(char);
+bool start_file_load(char *);
+void feed_file_load();
+bool kb_empty();
+uint32_t kb_free();
+void kb_push(uint8_t);
+uint8_t kb_pop();
 void show_display();
 void read_string(char *, int);
 void debug_step();
 void disassemble(uint16_t, uint16_t);
+int write_disassembly(char *, uint16_t, uint16_t, uint16_t *, int);
+int disassemble_to_file(char *);
 uint16_t next_inst_addr(uint16_t);
 int find_symbol(char *, uint16_t *);
+const char *symbol_at(uint16_t, uint16_t, uint16_t *);
+bool format_symbol(uint16_t, uint16_t, char *, int);
+char *addr_name(uint16_t);
+void search_memory(char *);
+int find_references(uint16_t, uint16_t, uint16_t);
+int take_snapshot(char *);
+int delete_snapshot(char *);
+void list_snapshots();
+int start_coverage(char *);
+int save_coverage(char *);
+void print_coverage_summary(char *);
+void start_heatmap(char *);
+void start_stats(char *);
+int write_stats(char *);
+extern uint8_t statsenabled6502;
+int save_heatmaps(char *);
+int diff_snapshots(char *, char *);
+int parse_addr_expr(char *, uint16_t *);
 
 uint8_t read6502(uint16_t);
 void write6502(uint16_t, uint8_t);
 
-uint8_t char_pending = 0;
+// Keys wait in a typeahead FIFO until the guest reads them from $D010.
+// -typeahead sets the size, which is rounded up to a power of 2.
+#define DEFAULT_TYPEAHEAD 4096
+uint8_t *kb_buffer;
+uint32_t kb_size = DEFAULT_TYPEAHEAD;
+uint32_t kb_head = 0;   // next slot filled from the host
+uint32_t kb_tail = 0;   // next key read by the guest
+
+#define KB_POLL_INTERVAL 256
+int kb_poll_count = 0;
+
+// A file being typed in with Ctrl-L or -load. The whole file is read
+// up front and fed into the typeahead buffer as fast as it drains.
 uint8_t reading_file = 0;
+char *load_file_name = NULL;
+char *basic_file_name = NULL;
+char *save_basic_file_name = NULL;
+char *disasm_file_name = NULL;
+char *load_buffer = NULL;
+long load_size = 0;
+long load_pos = 0;
+long load_start_time = 0;
 
 char input_line[512];
 
@@ -61,20 +264,47 @@ clock_t next_char_time;
 bool send_ready;
 
 bool debugging = false;
+// Set by Ctrl-C so the main loop can exit normally and write out reports
+volatile sig_atomic_t quit_requested = false;
 bool debug_run_to_breakpoint = false;
-uint16_t temp_breakpoint = 0;
+int temp_breakpoint = -1;  // -1 when there isn't one, 0000 is a valid address
+
+// Extra stop conditions for the run commands (s N, cycles N, finish).
+// These are checked in debug_step while running, so the instructions
+// are executed by the main loop without going back to the prompt.
+bool debug_count_steps = false;
+uint32_t debug_steps_left = 0;
+bool debug_count_cycles = false;
+uint32_t debug_cycle_goal = 0;
+bool debug_finish = false;
+uint8_t debug_finish_sp = 0;
+uint8_t debug_last_opcode = 0;
 
 int columns = 0;
 int curr_col = 0;
 
-struct sym_node {
-    char *name;
-    uint16_t value;
-    struct sym_node *left;
-    struct sym_node *right;
-};
-
-struct sym_node *sym_tree = NULL;
+// Apple-1 output is collected in a ring and written to stdout when the
+// guest waits for a key, when the ring fills up, or after
+// OUTPUT_FLUSH_MILLIS, instead of a write() per character.
+#define OUTPUT_BUFFER_SIZE 4096    // must be a power of 2
+#define OUTPUT_FLUSH_MILLIS 20
+#define OUTPUT_CHECK_INTERVAL 4096 // instructions between flush timer checks
+
+// With -outthread, a writer thread drains the ring instead. write6502 is
+// the only producer and the writer thread the only consumer, so the
+// head and tail indexes are all the synchronization needed. When the
+// ring is full, $D012 reports the display as busy.
+bool output_threaded = false;
+pthread_t output_thread;
+
+char output_buffer[OUTPUT_BUFFER_SIZE];
+_Atomic uint32_t output_head = 0;   // next slot written by write6502
+_Atomic uint32_t output_tail = 0;   // next slot to be written to stdout
+long output_start_time = 0; // when the oldest unflushed char was buffered
+int output_check_count = 0;
+
+// How far past a symbol an address can be and still be shown as symbol+offset
+#define SYMBOL_MAX_OFFSET 0x100
 
 int main(int argc, char *argv[]) {
 
@@ -84,8 +314,12 @@ int main(int argc, char *argv[]) {
         breakpoint[i] = false;
     }
 
+    // Registered first so it runs after the other exit handlers, in case
+    // they exit some other way than quit_if_requested
+    atexit(flush_output);
+
     // Load the Woz monitor (at FF00)
-    load_mem("monitor.rom", true);
+    load_builtin("monitor.rom", true);
 
     // Parse the command-line arguments
     for (int i=1; i < argc; i++) {
@@ -122,15 +356,85 @@ int main(int argc, char *argv[]) {
             printf("then locations C000-C200 are also marked as ROM. This emulator does not fully \n");
             printf("emulate the cassette interface from a timing perspective, but instead works with \n");
             printf("the cassette ROM to load/store each bit.\n");
-            printf("ROM and RAM files should be text files with lines in the format:\n");
+            printf("ROM and RAM files can be text files with lines in the format:\n");
             printf("aaaa: dd dd dd dd dd dd dd dd\n");
-            printf("where aaaa is a hex address, and each dd is a hex byte.\n");
-            printf("The parser is currently limited to 16 bytes per row.\n");
+            printf("where aaaa is a hex address, and each dd is a hex byte, or Intel HEX files.\n");
+            printf("A raw binary file is loaded with its load address after it, as in file.bin@0280.\n");
+            printf("Memory images written by the debugger's image command can be loaded too, and\n");
+            printf("keep their ROM areas as ROM when loaded with -rom.\n");
             printf("Since ROM files are loaded first, if a ROM and RAM file have overlapping addresses,\n");
             printf("the ROM wins and the memory is marked as read-only\n");
             printf("The emulator will automatically load the monitor.rom file.\n");
+            printf("-basic file loads a BASIC program straight into Woz BASIC's memory,\n");
+            printf("start BASIC with E2B3R to use it.\n");
+            printf("-savebasic file writes the Woz BASIC program in the memory loaded with -ram\n");
+            printf("to file as text (- for stdout) and exits without running the emulator.\n");
+            printf("-disasm file[,addr...] writes a disassembly of all memory to file and exits.\n");
+            printf("Code is found by following the reset and interrupt vectors and any extra\n");
+            printf("entry addresses (hex or @symbol), everything else is written as data.\n");
+            printf("-coverage file records which addresses are executed, read and written,\n");
+            printf("adding to file if it exists, and saves it on exit. Disassembly shows it.\n");
+            printf("-heatmap name.ppm counts accesses to each address and writes 256x256 heatmaps\n");
+            printf("of them on exit, as name-exec.ppm, name-read.ppm and name-write.ppm (or .png).\n");
+            printf("-stackbreak y drops into the debugger when the stack pointer wraps around.\n");
+            printf("-stats file counts each opcode, page crossing and branch taken, and writes\n");
+            printf("a report to file on exit (- for the terminal).\n");
+            printf("-disk image attaches a block storage device at C400 backed by the image\n");
+            printf("file (created if needed) and loads its driver ROM at C500.\n");
+            printf("-romcache n doesn't use or update the cache of parsed ROM files.\n");
+            printf("-hle y runs the monitor's ECHO and key wait natively, so the emulator sleeps\n");
+            printf("while waiting for a key. Those routines are then missing from -coverage,\n");
+            printf("-stats, -heatmap and the cycle counts.\n");
+            printf("-hostcall enables the host call device at C410 for native memory moves,\n");
+            printf("multiply, divide, compare and search.\n");
+            printf("-load file types in the contents of file at startup, like Ctrl-L.\n");
+            printf("-typeahead size sets how many keys can be typed ahead of the Apple-1 (default 4096).\n");
+            printf("-outthread writes the Apple-1 output from a separate thread, so a slow\n");
+            printf("terminal or pipe shows up as a busy display instead of stalling the CPU.\n");
 
             exit(0);
+        } else if (!strcmp(argv[i], "-hle")) {
+            if (i >= argc-1) {
+                printf("Must specify y or n for hle\n");
+                exit(1);
+            }
+            if ((argv[i+1][0] == 'y') || (argv[i+1][0] == 'Y')) {
+                hle_enabled = true;
+            } else if ((argv[i+1][0] == 'n') || (argv[i+1][0] == 'N')) {
+                hle_enabled = false;
+            } else {
+                printf("Must specify y or n for hle\n");
+                exit(1);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-stackbreak")) {
+            if (i >= argc-1) {
+                printf("Must specify y or n for stackbreak\n");
+                exit(1);
+            }
+            if ((argv[i+1][0] == 'y') || (argv[i+1][0] == 'Y')) {
+                stack_break = true;
+            } else if ((argv[i+1][0] == 'n') || (argv[i+1][0] == 'N')) {
+                stack_break = false;
+            } else {
+                printf("Must specify y or n for stackbreak\n");
+                exit(1);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-romcache")) {
+            if (i >= argc-1) {
+                printf("Must specify y or n for romcache\n");
+                exit(1);
+            }
+            if ((argv[i+1][0] == 'y') || (argv[i+1][0] == 'Y')) {
+                rom_cache_enabled = true;
+            } else if ((argv[i+1][0] == 'n') || (argv[i+1][0] == 'N')) {
+                rom_cache_enabled = false;
+            } else {
+                printf("Must specify y or n for romcache\n");
+                exit(1);
+            }
+            i++;
         } else if (!strcmp(argv[i], "-cassette")) {
             if (i >= argc-1) {
                 printf("Must specify y or n for cassette\n");
@@ -216,6 +520,85 @@ int main(int argc, char *argv[]) {
             i++;
         } else if (!strcmp(argv[i], "-d")) {
             debugging = true;
+        } else if (!strcmp(argv[i], "-typeahead")) {
+            if (i >= argc-1) {
+                printf("Must specify a buffer size after -typeahead\n");
+                exit(1);
+            }
+            int size;
+            if (sscanf(argv[i+1], "%d", &size) == 0) {
+                printf("Unable to parse typeahead size %s\n",argv[i+1]);
+                exit(1);
+            }
+            if ((size < 1) || (size > 1048576)) {
+                printf("Typeahead size must be between 1 and 1048576\n");
+                exit(1);
+            }
+            kb_size = 1;
+            while (kb_size < size) kb_size <<= 1;
+            i++;
+        } else if (!strcmp(argv[i], "-basic")) {
+            if (i >= argc-1) {
+                printf("Must specify a filename after -basic\n");
+                exit(1);
+            }
+            basic_file_name = argv[i+1];
+            i++;
+        } else if (!strcmp(argv[i], "-savebasic")) {
+            if (i >= argc-1) {
+                printf("Must specify a filename after -savebasic\n");
+                exit(1);
+            }
+            save_basic_file_name = argv[i+1];
+            i++;
+        } else if (!strcmp(argv[i], "-coverage")) {
+            if (i >= argc-1) {
+                printf("Must specify a filename after -coverage\n");
+                exit(1);
+            }
+            if (!start_coverage(argv[i+1])) {
+                exit(1);
+            }
+            i++;
+        } else if (!strcmp(argv[i], "-heatmap")) {
+            if (i >= argc-1) {
+                printf("Must specify a file name after -heatmap\n");
+                exit(1);
+            }
+            start_heatmap(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i], "-stats")) {
+            if (i >= argc-1) {
+                printf("Must specify a file name after -stats\n");
+                exit(1);
+            }
+            start_stats(argv[i+1]);
+            i++;
+        } else if (!strcmp(argv[i], "-disasm")) {
+            if (i >= argc-1) {
+                printf("Must specify a filename after -disasm\n");
+                exit(1);
+            }
+            disasm_file_name = argv[i+1];
+            i++;
+        } else if (!strcmp(argv[i], "-disk")) {
+            if (i >= argc-1) {
+                printf("Must specify a disk image after -disk\n");
+                exit(1);
+            }
+            disk_file_name = argv[i+1];
+            i++;
+        } else if (!strcmp(argv[i], "-hostcall")) {
+            hostcall_enabled = true;
+        } else if (!strcmp(argv[i], "-load")) {
+            if (i >= argc-1) {
+                printf("Must specify a filename after -load\n");
+                exit(1);
+            }
+            load_file_name = argv[i+1];
+            i++;
+        } else if (!strcmp(argv[i], "-outthread")) {
+            start_output_thread();
         } else if (!strcmp(argv[i], "-baud")) {
             if (i >= argc-1) {
                 printf("Must specify a baud rate after -baud\n");
@@ -251,13 +634,59 @@ int main(int argc, char *argv[]) {
 
     if (cassette_enabled) {
         // If cassette is enabled, load the Woz cassette interface
-        load_mem("wozaci.rom", true);
+        load_builtin("wozaci.rom", true);
+        add_cassette_hooks();
+    }
+
+    if (disk_file_name != NULL) {
+        if (!open_disk(disk_file_name)) {
+            exit(1);
+        }
+        load_builtin("disk.rom", true);
     }
 
     for (int i=max_ram; i < sizeof(ram); i++) {
         rom[i] = true;
     }
 
+    if (hle_enabled) {
+        add_hle_hooks();
+    }
+
+    if (basic_file_name != NULL) {
+        if (!basic_loaded()) {
+            printf("Woz BASIC isn't loaded, use -rom wozbasic.rom with -basic\n");
+            exit(1);
+        }
+        if (!load_basic(basic_file_name)) {
+            exit(1);
+        }
+        printf("Start BASIC with E2B3R to keep the program.\n");
+    }
+
+    // -savebasic just pulls the program out of the loaded memory image
+    if (save_basic_file_name != NULL) {
+        exit(save_basic(save_basic_file_name) ? 0 : 1);
+    }
+    if (disasm_file_name != NULL) {
+        exit(disassemble_to_file(disasm_file_name) ? 0 : 1);
+    }
+
+    kb_buffer = (uint8_t *) malloc(kb_size);
+
+    if ((load_file_name != NULL) && !start_file_load(load_file_name)) {
+        exit(1);
+    }
+
+    // Ctrl-C exits through quit_if_requested rather than killing us, and
+    // interrupts a blocking read instead of restarting it
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigint;
+    sigaction(SIGINT, &action, NULL);
+
+    hookstackwrap(stack_wrapped);
+
     // Reset the CPU
     reset6502();
 
@@ -275,28 +704,36 @@ int main(int argc, char *argv[]) {
             }
         }
 
+        if (coverage_enabled) {
+            COVER(COVER_EXEC, pc);
+        }
+        if (heatmap_enabled) {
+            HEAT(HEAT_EXEC, pc);
+        }
         do_step();
+        if (quit_requested) {
+            quit_if_requested();
+        }
 
         // Check where the CPU is
-        check_pc();
-
-        // If a key has been hit, process it
-        if (kbhit(false)) {
-            handle_kb();
-        }
-        if (reading_file && !char_pending) {
-            char ch;
-            if (fread(&ch, 1, 1, input_file) < 1) {
-                fclose(input_file);
-                reading_file = 0;
-                printf("File loaded.\n");
-            } else {
-                if (ch == 0x0a) {
-                    ch = 0x0d;
-                }
-                char_pending = ch;
+        if (hooked_page[pc >> 8] && (pc_hooks[pc] != NULL)) {
+            pc_hooks[pc]();
+        }
+
+        check_output_flush();
+
+        // If keys have been hit, process them. Checking takes a system
+        // call, so only do it every KB_POLL_INTERVAL instructions.
+        if (++kb_poll_count >= KB_POLL_INTERVAL) {
+            kb_poll_count = 0;
+            int available = kbhit(false);
+            if (available) {
+                handle_kb(available);
             }
         }
+        if (reading_file) {
+            feed_file_load();
+        }
     }
 }
 
@@ -337,6 +774,19 @@ int kbhit(bool init) {
     return nbbytes;
 }
 
+void handle_sigint(int sig) {
+    quit_requested = true;
+}
+
+void quit_if_requested() {
+    if (quit_requested) {
+        // Show the rest of the guest's output before any exit reports
+        flush_output();
+        reset_term();
+        exit(0);
+    }
+}
+
 void reset_term() {
     static const int STDIN = 0;
 
@@ -350,10 +800,147 @@ void reset_term() {
     setbuf(stdin, NULL);
 }
 
+long current_time_millis() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000l + ts.tv_nsec / 1000000l;
+}
+
+/* Writes everything in the output ring to stdout. With -outthread it
+ * waits for the writer thread to do it. */
+void flush_output() {
+    uint32_t head = atomic_load_explicit(&output_head, memory_order_relaxed);
+
+    if (output_threaded) {
+        // The writer thread owns the tail, wait for it to catch up
+        while (atomic_load_explicit(&output_tail, memory_order_acquire) != head) {
+            usleep(100);
+        }
+        return;
+    }
+
+    uint32_t tail = atomic_load_explicit(&output_tail, memory_order_relaxed);
+    while (tail != head) {
+        uint32_t start = tail & (OUTPUT_BUFFER_SIZE-1);
+        uint32_t count = head - tail;
+
+        // Write up to the end of the buffer, the rest goes on the next pass
+        if (start + count > OUTPUT_BUFFER_SIZE) {
+            count = OUTPUT_BUFFER_SIZE - start;
+        }
+        fwrite(&output_buffer[start], 1, count, stdout);
+        tail += count;
+    }
+    atomic_store_explicit(&output_tail, tail, memory_order_relaxed);
+    fflush(stdout);
+}
+
+bool output_full() {
+    return atomic_load_explicit(&output_head, memory_order_relaxed) -
+        atomic_load_explicit(&output_tail, memory_order_acquire) == OUTPUT_BUFFER_SIZE;
+}
+
+void output_char(char ch) {
+    uint32_t head = atomic_load_explicit(&output_head, memory_order_relaxed);
+
+    if (output_full()) {
+        if (output_threaded) {
+            // Like the real PIA, a char stored while the display is busy is lost
+            return;
+        }
+        flush_output();
+    }
+    if (!output_threaded && (head == atomic_load_explicit(&output_tail, memory_order_relaxed))) {
+        output_start_time = current_time_millis();
+    }
+    output_buffer[head & (OUTPUT_BUFFER_SIZE-1)] = ch;
+    atomic_store_explicit(&output_head, head+1, memory_order_release);
+}
+
+/* Called from the main loop, flushes output that has waited too long */
+void check_output_flush() {
+    if (output_threaded) return;
+    if (output_head == output_tail) return;
+    if (++output_check_count < OUTPUT_CHECK_INTERVAL) return;
+    output_check_count = 0;
+    if (current_time_millis() - output_start_time >= OUTPUT_FLUSH_MILLIS) {
+        flush_output();
+    }
+}
+
+/* The -outthread writer, copies the output ring to stdout */
+void *output_writer(void *arg) {
+    for (;;) {
+        uint32_t tail = atomic_load_explicit(&output_tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&output_head, memory_order_acquire);
+        if (head == tail) {
+            usleep(1000);
+            continue;
+        }
+        // The emulator's own messages go through stdio, get them out
+        // before guest output that came after them
+        fflush(stdout);
+
+        uint32_t start = tail & (OUTPUT_BUFFER_SIZE-1);
+        uint32_t count = head - tail;
+        if (start + count > OUTPUT_BUFFER_SIZE) {
+            count = OUTPUT_BUFFER_SIZE - start;
+        }
+        ssize_t written = write(STDOUT_FILENO, &output_buffer[start], count);
+        if (written > 0) {
+            atomic_store_explicit(&output_tail, tail + written, memory_order_release);
+        } else if ((written < 0) && (errno != EINTR) && (errno != EAGAIN)) {
+            // Output has gone away, keep draining so the guest doesn't hang
+            atomic_store_explicit(&output_tail, head, memory_order_release);
+        }
+    }
+    return NULL;
+}
+
+void start_output_thread() {
+    // Anything printed before now went through stdout
+    fflush(stdout);
+    if (pthread_create(&output_thread, NULL, output_writer, NULL) != 0) {
+        fprintf(stderr, "Unable to start output thread, using buffered output\n");
+        return;
+    }
+    pthread_detach(output_thread);
+    output_threaded = true;
+}
+
 char line[1024];
 
+/* Loads one of the ROMs built into froot1, or the file if it isn't */
+int load_builtin(char *filename, bool read_only) {
+    bool found = false;
+
+    for (int i=0; i < builtin_rom_count; i++) {
+        const struct builtin_rom *builtin = &builtin_roms[i];
+        if (!strcmp(builtin->name, filename)) {
+            memcpy(&ram[builtin->addr], builtin->data, builtin->len);
+            memset(&rom[builtin->addr], read_only, builtin->len);
+            found = true;
+        }
+    }
+    return found || load_mem(filename, read_only);
+}
+
+// Addresses loaded by the current load_mem, to save in the ROM cache
+bool mem_loaded[65536];
+
+/* Called by the ROM parser for each row, context points to read_only */
+void store_mem_row(void *context, uint32_t addr, const uint8_t *bytes, int count) {
+    memcpy(&ram[addr], bytes, count);
+    memset(&rom[addr], *(bool *) context, count);
+    memset(&mem_loaded[addr], true, count);
+}
+
+/* Loads a Woz dump or Intel HEX file, a memory image, or a raw binary
+ * file given as file@addr */
 int load_mem(char *filename, bool read_only) {
     FILE *in;
+    char name[512];
+    int binary_addr = -1;
 
     const char* const DATADIRS[] = {
         "/usr/local/share/froot-1",
@@ -361,212 +948,124 @@ int load_mem(char *filename, bool read_only) {
     };
     const int DATADIRS_COUNT = 2;
 
+    // file@addr is a raw binary file to load at addr
+    snprintf(name, sizeof(name), "%s", filename);
+    char *at = strrchr(name, '@');
+    if ((at != NULL) && (at[1] != 0) && (strlen(at+1) <= 4)) {
+        int addr = 0;
+        char *p;
+        for (p = at+1; hex_digit_value(*p) >= 0; p++) {
+            addr = (addr << 4) + hex_digit_value(*p);
+        }
+        if (*p == 0) {
+            *at = 0;
+            binary_addr = addr;
+        }
+    }
+
     // Open the input file
-    if ((in = fopen(filename, "r")) == NULL) {
+    if ((in = fopen(name, "r")) == NULL) {
         for (int i=0; i<DATADIRS_COUNT; i++) {
-            snprintf(line, sizeof(line)-1, "%s/%s", DATADIRS[i], filename);
+            snprintf(line, sizeof(line)-1, "%s/%s", DATADIRS[i], name);
             if ((in = fopen(line, "r")) != NULL) {
                 break;
             }
         }
 
         if (in == NULL) {
-            fprintf(stderr, "Can't open file %s\n", filename);
+            fprintf(stderr, "Can't open file %s\n", name);
             return 0;
         }
     }
 
-    // Read it line-by line
-    while (fgets(line, sizeof(line), in)) {
-        if (strlen(line) == 0) continue;
-        
-        int addr = 0;
-        int pos = 0;
-        int len = strlen(line);
-        unsigned char row[16];
-
-        int addr_len = 0;
-        int byte_len = 0;
-        int curr_byte = 0;
-        bool got_colon = false;
-        int byte_count = 0;
-
-        // Parse to the end of the line
-        while (pos < len) {
-            char ch = line[pos++];
-
-            // Is the next char a hex digit?
-            if (((ch >= '0') && (ch <= '9')) ||
-                ((ch >= 'a') && (ch <= 'f')) ||
-                ((ch >= 'A') && (ch <= 'F'))) {
-
-                // Have we parsed the 4-digit address but not seen a : yet?
-                if ((addr_len == 4) && !got_colon) {
-                    fprintf(stderr, "No : after 4-digit address in %s at line %s\n", filename, line);
-                    fclose(in);
-                    return 0;
-                }
-                unsigned char nybble;
-
-                // Convert the digit to a nybble
-                if ((ch >= '0') && (ch <= '9')) {
-                    nybble = ch - '0';
-                } else if ((ch >= 'a') && (ch <= 'f')) {
-                    nybble = 10 + ch - 'a';
-                } else if ((ch >= 'A') && (ch <= 'F')) {
-                    nybble = 10 + ch - 'A';
-                }
-
-                // If we are still in the address, add the nybble to the address
-                if (addr_len < 4) {
-                    addr = (addr << 4) + nybble;
-                    addr_len++;
-                } else {
-                    // If we already have 16 bytes on this line and see another digit, that's an error
-                    if (byte_count == 16) {
-                        fprintf(stderr, "Got more than 16 bytes in %s at line %s\n", filename, line);
-                        fclose(in);
-                        return 0;
-                    }
-                    // Add the nybble to the current byte
-                    curr_byte = (curr_byte << 4) + nybble;
-                    byte_len++;
-
-                    // If we have a complete byte, add it to the row
-                    if (byte_len == 2) {
-                        row[byte_count] = curr_byte;
-                        byte_count++;
-                        curr_byte = 0;
-                        byte_len = 0;
-                    }
-                }
-            } else if (ch == ':') {
-                if (addr_len < 4) {
-                    fprintf(stderr, "Got : before 4-digit address in %s at %s\n", filename, line);
-                    fclose(in);
-                    return 0;
-                } else if (got_colon) {
-                    fprintf(stderr, "Got extra : in %s at %s\n", filename, line);
-                    fclose(in);
-                    return 0;
-                }
+    if (binary_addr >= 0) {
+        int result = parse_binary_stream(in, name, binary_addr, store_mem_row, &read_only);
+        fclose(in);
+        return result;
+    }
 
-                got_colon = true;
-            } else {
-            }
+    // Binary images, and text files that are already in the ROM cache,
+    // are copied straight into memory
+    size_t map_len;
+    uint8_t *map = map_file(fileno(in), &map_len);
+    uint64_t hash = 0;
+    if (map != NULL) {
+        if (is_image(map, map_len)) {
+            int result = load_image(map, map_len, read_only, filename);
+            munmap(map, map_len);
+            fclose(in);
+            return result;
         }
-
-        // Write the row into ram and update the rom flag appropriately
-        for (int i=0; i < byte_count; i++) {
-            ram[addr+i] = row[i];
-            rom[addr+i] = read_only;
+        hash = hash_bytes(map, map_len);
+        munmap(map, map_len);
+        if (rom_cache_enabled && load_cached_rom(hash, read_only)) {
+            fclose(in);
+            return 1;
         }
     }
+
+    memset(mem_loaded, 0, sizeof(mem_loaded));
+    int result = parse_rom_stream(in, filename, store_mem_row, &read_only);
     fclose(in);
-    return 1;
+    if (result && (map != NULL) && rom_cache_enabled) {
+        save_cached_rom(hash, mem_loaded);
+    }
+    return result;
 }
 
-int load_syms(char *filename) {
-    FILE *in;
-
-    printf("Loading symbols from %s\n", filename);
-    // Open the input file
-    if ((in = fopen(filename, "r")) == NULL) {
-        snprintf(line, sizeof(line)-1, "/usr/local/share/froot-1/%s", filename);
-        if ((in = fopen(line, "r")) == NULL) {
-            fprintf(stderr, "Can't open file %s\n", filename);
+/* Handles -disasm file,addr,addr... once memory and symbols are loaded */
+int disassemble_to_file(char *arg) {
+    uint16_t entries[64];
+    int entry_count = 0;
+    char *comma = strchr(arg, ',');
+
+    while (comma != NULL) {
+        *comma++ = 0;
+        char *next = strchr(comma, ',');
+        if (next != NULL) *next = 0;
+        if (entry_count == 64) {
+            printf("Too many entry addresses for -disasm\n");
             return 0;
         }
-    }
-
-    // Read it line-by line
-    while (fgets(line, sizeof(line), in)) {
-        if (strlen(line) == 0) continue;
-        if (strncmp(line, "sym", 3)) continue;
-        
-        char *name_start = strstr(line, "name=\"");
-        if (!name_start) continue;
-        char *val_start = strstr(line, "val=0x");
-        if (!val_start) continue;
-
-        char *name = name_start + 6;
-        char *quote_pos = strchr(name, '"');
-        if (quote_pos == NULL) continue;
-        *quote_pos = 0;
-
-        char *val_str = val_start + 6;
-        char *comma_pos = strchr(val_str, ',');
-        if (comma_pos == NULL) continue;
-        *comma_pos = 0;
-
-        int val;
-        if (sscanf(val_str, "%x", &val) == 0) continue;
-
-        struct sym_node *new_node = (struct sym_node *) malloc(sizeof(struct sym_node));
-        new_node->name = malloc(strlen(name)+1);
-        strcpy(new_node->name, name);
-        new_node->value = val;
-        new_node->left = NULL;
-        new_node->right = NULL;
-
-        if (sym_tree == NULL) {
-            sym_tree = new_node;
-        } else {
-            struct sym_node *curr = sym_tree;
-            while (curr != NULL ) {
-                int res = strcmp(name, curr->name);
-                if (res == 0) {
-                    break;
-                } else if (res < 0) {
-                    if (curr->left == NULL) {
-                        curr->left = new_node;
-                        break;
-                    } else {
-                        curr = curr->left;
-                    }
-                } else {
-                    if (curr->right == NULL) {
-                        curr->right = new_node;
-                        break;
-                    } else {
-                        curr = curr->right;
-                    }
-                }
-            }
+        if (!parse_addr_expr(comma, &entries[entry_count++])) {
+            return 0;
         }
+        comma = next;
     }
-    fclose(in);
-    return 1;
+    return write_disassembly(arg, 0, 0xffff, entries, entry_count);
 }
 
-int find_symbol(char *symbol, uint16_t *value) {
-    struct sym_node *curr;
+/* Writes the Woz BASIC program in memory to a text file, or stdout for - */
+int save_basic(char *filename) {
+    FILE *out;
 
-    curr = sym_tree;
-    while (curr != NULL) {
-        int res = strcmp(symbol, curr->name);
-        if (res == 0) {
-            *value = curr->value;
-            return 1;
-        } else if (res < 0) {
-            curr = curr->left;
-        } else {
-            curr = curr->right;
-        }
+    if (!strcmp(filename, "-")) {
+        return list_basic(stdout) >= 0;
+    }
+    if ((out = fopen(filename, "w")) == NULL) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        return 0;
     }
-    return 0;
+    int count = list_basic(out);
+    fclose(out);
+    if (count < 0) {
+        return 0;
+    }
+    printf("Saved %d BASIC lines to %s\n", count, filename);
+    return 1;
 }
 
-
 void begin_write_cassette() {
     // If we are already writing, don't prompt for another file
     // The Apple-1 cassette interface can write multiple address
     // ranges to the cassette
     if (cassette_file != NULL) return;
+    flush_output();
     reset_term();
     for (;;) {
         printf("Cassette save to file (enter=cancel): ");
         fgets(input_line, sizeof(input_line)-1, stdin);
+        quit_if_requested();
         int len = strlen(input_line);
         if ((len > 0) && (input_line[len-1] == '\n')) {
             input_line[len-1] = 0;
@@ -581,6 +1080,11 @@ void begin_write_cassette() {
             printf("Unable to open file %s for writing, try again\n", input_line);
             continue;
         }
+        cassette_writing = true;
+        cassette_wav = is_wav_file(input_line);
+        if (cassette_wav) {
+            wav_write_start(cassette_file);
+        }
         break;
     }
     // kbhit(true) puts the terminal back in raw mode
@@ -592,10 +1096,12 @@ void begin_read_cassette() {
     // The Apple-1 cassette interface can read multiple address
     // ranges from the cassette
     if (cassette_file != NULL) return;
+    flush_output();
     reset_term();
     for (;;) {
         printf("Cassette file to read (enter=cancel): ");
         fgets(input_line, sizeof(input_line)-1, stdin);
+        quit_if_requested();
         int len = strlen(input_line);
         if ((len > 0) && (input_line[len-1] == '\n')) {
             input_line[len-1] = 0;
@@ -610,122 +1116,375 @@ void begin_read_cassette() {
             printf("Unable to open file %s for reading, try again\n", input_line);
             continue;
         }
+        cassette_writing = false;
+        cassette_wav = is_wav_file(input_line);
+        if (cassette_wav && !wav_read_start(cassette_file)) {
+            fclose(cassette_file);
+            cassette_file = NULL;
+            continue;
+        }
         break;
     }
     // kbhit(true) puts the terminal back in raw mode
     kbhit(true);
 }
 
-int cassette_read() {
-    unsigned char ch;
-    if (cassette_file == NULL) {
-        return -1;
+/* The ACI keeps the current address in HEX2 ($26) and the end address
+ * in HEX1 ($24). Like its INCADDR loop, a range whose start is past the
+ * end still moves one byte. */
+#define ACI_HEX1 0x24
+#define ACI_HEX2 0x26
+#define ACI_SAVEINDEX 0x28
+
+int cassette_range(uint16_t *start) {
+    uint16_t end = ram[ACI_HEX1] | (ram[ACI_HEX1+1] << 8);
+    *start = ram[ACI_HEX2] | (ram[ACI_HEX2+1] << 8);
+    if (*start > end) {
+        return 1;
     }
-    if (fread(&ch, 1, 1, cassette_file) == 0) {
-        return -1;
+    return end - *start + 1;
+}
+
+void cassette_set_address(uint16_t addr) {
+    ram[ACI_HEX2] = addr & 0xff;
+    ram[ACI_HEX2+1] = addr >> 8;
+}
+
+/* Writes the whole address range to the cassette file in one go */
+void cassette_write_range() {
+    uint16_t start;
+    int count = cassette_range(&start);
+
+    if (cassette_wav) {
+        wav_write_record(cassette_file, &ram[start], count);
+    } else if (cassette_file != NULL) {
+        fwrite(&ram[start], 1, count, cassette_file);
     }
-    return ch;
+    cassette_set_address(start + count);
 }
 
-void cassette_write(unsigned char ch) {
-    if (cassette_file != NULL) {
-        fwrite(&ch, 1, 1, cassette_file);
+/* Reads the whole address range from the cassette file, returns false if
+ * the file ran out first. ROM is left alone, as it would be by STA. */
+bool cassette_read_range() {
+    static uint8_t buffer[65536];
+    uint16_t start;
+    int count = cassette_range(&start);
+    int num_read = 0;
+
+    if (cassette_wav) {
+        // Each range is a separate record, with its own leader
+        if ((num_read = wav_read_record(cassette_file, buffer, count)) < 0) {
+            num_read = 0;
+        }
+    } else if (cassette_file != NULL) {
+        num_read = fread(buffer, 1, count, cassette_file);
     }
+    for (int i=0; i < num_read; i++) {
+        if (!rom[(uint16_t) (start+i)]) {
+            ram[(uint16_t) (start+i)] = buffer[i];
+        }
+    }
+    cassette_set_address(start + num_read);
+    return num_read == count;
+}
+
+bool is_wav_file(char *filename) {
+    int len = strlen(filename);
+    return (len > 4) && !strcasecmp(filename + len - 4, ".wav");
 }
 
 void cassette_end() {
     if (cassette_file != NULL) {
+        if (cassette_wav && cassette_writing) {
+            wav_write_finish(cassette_file);
+        }
         fclose(cassette_file);
         cassette_file = NULL;
     }
+    flush_output();
     printf("Cassette finished.\n");
 }
 
-/* check_pc is a hack to get the cassette interface to work.
- * It doesn't work yet. */
-void check_pc() {
-    if (cassette_enabled) {
-        if (pc == 0xc170) { // ACI - WRITE, skip to WRNEXT
-            ram[0x28] = x; // save X in SAVEINDEX, since we skip WHEADER, we need to do this
-            begin_write_cassette();
-            if (cassette_file == NULL) {
-                pc = 0xc163; // Quit if no filename entered
-            } else {
-                pc = 0xc175;
-            }
-        } else if (pc == 0xc17c) {  // ACI - WBITLOOP
-            cassette_write(a);
-            pc = 0xc182; // skip write bit loop, jump to increment address
-        } else if (pc == 0xc18d)  { // ACI - READ
-            begin_read_cassette();
-            if (cassette_file == NULL) {
-                pc = 0xc163; // Quit if no filename entered
-            } else {
-                ram[0x28] = x; // save X in SAVEINDEX, since we skip WHEADER, we need to do this
-                char ch = cassette_read();
-                if (ch < 0) {
-                    status = status | 1; // Set carry
-                    pc = 0xc189;
-                } else {
-                    a = ch;
-                    x = 0;
-                    pc = 0xc1b1;  // save new byte
-                }
-            }
-        } else if (pc == 0xc1a4) {  // ACI - RDBYTE
-            int ch = cassette_read();
-            if (ch < 0) {
-                status = status | 1; // Set carry
-                pc = 0xc189;
-            } else {
-                a = ch;
-                x = 0;
-                pc = 0xc1b1;  // save new byte
-            }
-        } else if (pc == 0xc189) {
-            status = status | 1; // Set carry
-        } else if (pc == 0xc163) {  // ACI - GOESC
-            // Don't end the cassette operation until there was no more
-            // import for the cassette monitor in case it is reading/writing
-            // multiple memory ranges
-            cassette_end();
-        }
+void add_pc_hook(uint16_t addr, void (*hook)()) {
+    pc_hooks[addr] = hook;
+    hooked_page[addr >> 8] = true;
+}
+
+/* The cassette hooks are a hack to get the cassette interface to work.
+ * Once the ACI has parsed a range for R or W, the whole range is copied
+ * between memory and the file and the ACI resumes at RESTIDX to look
+ * for the next range on the command line. */
+void aci_write() {
+    ram[ACI_SAVEINDEX] = x; // save X in SAVEINDEX, since we skip WHEADER, we need to do this
+    begin_write_cassette();
+    if (cassette_file == NULL) {
+        pc = 0xc163; // Quit if no filename entered
+    } else {
+        cassette_write_range();
+        status = status | 1; // Set carry
+        pc = 0xc189; // RESTIDX
+    }
+}
+
+void aci_read() {
+    begin_read_cassette();
+    if (cassette_file == NULL) {
+        pc = 0xc163; // Quit if no filename entered
+    } else {
+        ram[ACI_SAVEINDEX] = x; // save X in SAVEINDEX, since we skip WHEADER, we need to do this
+        cassette_read_range();
+        status = status | 1; // Set carry
+        pc = 0xc189; // RESTIDX
     }
 }
 
-/* Handle local keyboard interaction. */
-void handle_kb() {
-    char ch;
-    int len;
-    uint16_t addr, save_len;
-    FILE *loadfile;
+void aci_restidx() {
+    status = status | 1; // Set carry
+}
 
-    ch = getchar();
+void aci_goesc() {
+    // Don't end the cassette operation until there was no more
+    // import for the cassette monitor in case it is reading/writing
+    // multiple memory ranges
+    cassette_end();
+}
 
-    if (ch == 18) {                 // Ctrl-R
-        printf("RESET\n");
-        reset6502();
-    } else if (ch == 4) {   // Ctrl-D
+void add_cassette_hooks() {
+    add_pc_hook(0xc170, aci_write);     // ACI - WRITE
+    add_pc_hook(0xc18d, aci_read);      // ACI - READ
+    add_pc_hook(0xc189, aci_restidx);   // ACI - RESTIDX
+    add_pc_hook(0xc163, aci_goesc);     // ACI - GOESC
+}
+
+/* Called by fake6502 when a push goes below 0100 or a pull above 01FF */
+void stack_wrapped(uint8_t overflow) {
+    if (overflow) {
+        stack_overflows++;
+    } else {
+        stack_underflows++;
+    }
+    if (stack_break) {
+        flush_output();
+        printf("\nStack %s at %s\n", overflow ? "overflow" : "underflow", addr_name(instpc6502));
         debugging = true;
-        printf("Debugging mode.\n");
-    } else if (ch == 3) {           // Ctrl-C
-        reset_term();
-        exit(0);
-    } else if (char_pending || reading_file) {
-        // If the last character hasn't been processed, push this one back
-        ungetc(ch, stdin);
+        debug_run_to_breakpoint = false;
+    }
+}
+
+/* The debugger's stack command */
+void stack_report() {
+    printf("sp=%02x, %d bytes in use\n", sp, 0xff - sp);
+    printf("Deepest: sp=%02x (%d bytes) by the instruction at %s\n", stacklow6502,
+        0xff - stacklow6502, addr_name(stacklowpc6502));
+    printf("Wrapped around: %u overflows, %u underflows\n", stack_overflows, stack_underflows);
+
+    // Show the subroutines that were called the deepest
+    static bool shown[65536];
+    memset(shown, 0, sizeof(shown));
+    for (int i=0; i < 10; i++) {
+        int deepest = -1;
+        for (int addr=0; addr < 65536; addr++) {
+            if (!shown[addr] && calldepth6502[addr] &&
+                ((deepest < 0) || (calldepth6502[addr] > calldepth6502[deepest]))) {
+                deepest = addr;
+            }
+        }
+        if (deepest < 0) break;
+        if (i == 0) printf("Deepest calls (stack bytes in use on entry):\n");
+        printf("  %-30s %d\n", addr_name(deepest), calldepth6502[deepest]);
+        shown[deepest] = true;
+    }
+}
+
+/* Simulates an RTS at the end of a routine handled natively */
+void hle_return() {
+    uint16_t lo = ram[0x100 + (uint8_t) (sp+1)];
+    uint16_t hi = ram[0x100 + (uint8_t) (sp+2)];
+    sp += 2;
+    pc = ((hi << 8) | lo) + 1;
+}
+
+/* ECHO: BIT $D012, BMI ECHO, STA $D012, RTS. If the display is busy the
+ * guest keeps polling it itself, so baud rate limiting still works. */
+void hle_echo() {
+    if (debugging || (read6502(0xd012) & 0x80)) {
+        return;
+    }
+    write6502(0xd012, a);
+    // As left by the BIT of a ready display
+    status = (status & ~(FLAG_SIGN | FLAG_OVERFLOW)) | FLAG_ZERO;
+    hle_return();
+}
+
+/* NEXTCHAR in GETLINE: LDA $D011, BPL NEXTCHAR, LDA $D010. While there
+ * is no key, wait for one on the host instead of spinning the guest. */
+void hle_key_wait() {
+    if (debugging) {
+        return;
+    }
+    if (kb_empty() && !reading_file) {
+        if (!output_threaded && (output_head != output_tail)) {
+            flush_output();
+        }
+        fd_set fds;
+        struct timeval timeout = { 0, HLE_KEY_WAIT_MILLIS * 1000 };
+        FD_ZERO(&fds);
+        FD_SET(0, &fds);
+        select(1, &fds, NULL, NULL, &timeout);
+        int available = kbhit(false);
+        if (available) {
+            handle_kb(available);
+        }
+    }
+    if (kb_empty() || debugging) {
+        return;
+    }
+    a = read6502(0xd010);
+    status = (status & ~(FLAG_SIGN | FLAG_ZERO)) | (a & FLAG_SIGN) | (a ? 0 : FLAG_ZERO);
+    pc = 0xff31;
+}
+
+/* Only hooks the monitor routines if they are the ones in monitor.rom */
+void add_hle_hooks() {
+    static const uint8_t echo[] = { 0x2c, 0x12, 0xd0, 0x30, 0xfb, 0x8d, 0x12, 0xd0, 0x60 };
+    static const uint8_t key_wait[] = { 0xad, 0x11, 0xd0, 0x10, 0xfb, 0xad, 0x10, 0xd0 };
+
+    if (!memcmp(&ram[0xffef], echo, sizeof(echo))) {
+        add_pc_hook(0xffef, hle_echo);
+    }
+    if (!memcmp(&ram[0xff29], key_wait, sizeof(key_wait))) {
+        add_pc_hook(0xff29, hle_key_wait);
+    }
+}
+
+/* Reads a whole file in for Ctrl-L or -load */
+bool start_file_load(char *filename) {
+    FILE *in;
+
+    if ((in = fopen(filename, "rb")) == NULL) {
+        printf("Unable to open file %s\n", filename);
+        return false;
+    }
+    fseek(in, 0, SEEK_END);
+    long size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+
+    free(load_buffer);
+    load_buffer = (char *) malloc(size > 0 ? size : 1);
+    if ((size < 0) || (load_buffer == NULL) ||
+        (fread(load_buffer, 1, size, in) != size)) {
+        printf("Unable to read file %s\n", filename);
+        fclose(in);
+        return false;
+    }
+    fclose(in);
+
+    load_size = size;
+    load_pos = 0;
+    load_start_time = current_time_millis();
+    reading_file = 1;
+    return true;
+}
+
+/* Called from the main loop, tops up the typeahead buffer from the file
+ * being loaded. The load is done once the guest has read the last key. */
+void feed_file_load() {
+    while ((load_pos < load_size) && (kb_free() > 0)) {
+        char ch = load_buffer[load_pos++];
+        if (ch == 0x0a) {
+            // A CR LF line ending was already sent as a CR
+            if ((load_pos > 1) && (load_buffer[load_pos-2] == 0x0d)) continue;
+            ch = 0x0d;
+        }
+        kb_push(ch);
+    }
+
+    if ((load_pos == load_size) && kb_empty()) {
+        reading_file = 0;
+        free(load_buffer);
+        load_buffer = NULL;
+        flush_output();
+        printf("File loaded, %ld bytes in %ld ms.\n", load_size,
+            current_time_millis() - load_start_time);
+    }
+}
+
+bool kb_empty() {
+    return kb_head == kb_tail;
+}
+
+uint32_t kb_free() {
+    return kb_size - (kb_head - kb_tail);
+}
+
+void kb_push(uint8_t ch) {
+    if (kb_free() == 0) return;
+    kb_buffer[kb_head & (kb_size-1)] = ch;
+    kb_head++;
+}
+
+uint8_t kb_pop() {
+    if (kb_empty()) return 0;
+    uint8_t ch = kb_buffer[kb_tail & (kb_size-1)];
+    kb_tail++;
+    return ch;
+}
+
+/* Handle local keyboard interaction. Control keys always work, other
+ * keys that don't fit in the typeahead buffer are dropped, like keys hit
+ * on the real Apple-1 before it read the last one. */
+void handle_kb(int available) {
+    char keys[256];
+
+    int count = available;
+    if (count > sizeof(keys)) {
+        count = sizeof(keys);
+    }
+    count = read(STDIN_FILENO, keys, count);
+
+    for (int i=0; i < count; i++) {
+        handle_key(keys[i]);
+    }
+}
+
+void handle_key(char ch) {
+    // Anything the emulator prints itself has to come after the guest's
+    // output. With -outthread this waits for the writer, so only do it
+    // for the keys that print.
+    if ((ch == 18) || (ch == 4) || (ch == 12)) {
+        flush_output();
+    }
+
+    if (ch == 18) {                 // Ctrl-R
+        printf("RESET\n");
+        reset6502();
+    } else if (ch == 4) {   // Ctrl-D
+        debugging = true;
+        // Also interrupts a running c, s N, cycles, until or finish
+        debug_run_to_breakpoint = false;
+        printf("Debugging mode.\n");
+    } else if (ch == 3) {           // Ctrl-C
+        quit_requested = true;
+        quit_if_requested();
+    } else if ((ch == 12) && reading_file) {  // Ctrl-L during a load shows progress
+        printf("\nLoaded %ld of %ld bytes (%ld%%)\n", load_pos, load_size,
+            load_size > 0 ? 100 * load_pos / load_size : 100);
+    } else if (reading_file) {
+        // Keep typing from getting mixed into the file being loaded
+        return;
     } else if (ch == 10) {
         // Convert a newline to carriage-return
-        char_pending = 13;
+        kb_push(13);
     } else if (ch == 8 || ch == 0x7f) {
         // Backspace or delete were originally converted to 3f (?) because that's what
         // the Apple-1 uses for delete. I patched monitor.rom so that 8 is a backspace
         // instead of 3F
-        char_pending = 8;
+        kb_push(8);
     } else if (ch == 12) {  // Ctrl-L
         printf("Load from file: ");
         reset_term();
         fgets(input_line, sizeof(input_line)-1, stdin);
+        quit_if_requested();
         kbhit(true);
         int len = strlen(input_line);
         if ((len > 0) && (input_line[len-1] == '\n')) {
@@ -733,36 +1492,49 @@ void handle_kb() {
         }
         len = strlen(input_line);
         if (len > 0) {
-            input_file = fopen(input_line, "r");
-            if (input_file != NULL) {
-                reading_file = 1;
-            } else {
-                printf("Unable to open file %s\n", input_line);
-            }
+            start_file_load(input_line);
         }
     } else if ((ch >= 'a') && (ch <= 'z')) {
         // Apple-1 only supported uppercase
-        char_pending = ch - 'a' + 'A';
+        kb_push(ch - 'a' + 'A');
     } else {
-        char_pending = ch;
+        kb_push(ch);
     }
 }
 
 /* Callback from the fake6502 library, handle reads from RAM or the RIOT chips */
 uint8_t read6502(uint16_t address) {
 //    printf("reading %04x, pc = %04x\n", address, pc);
+    // Opcode and operand fetches are always within a byte of pc, leave
+    // them out so read coverage and counts are just data
+    if ((uint16_t) (address - pc + 1) > 2) {
+        if (coverage_enabled) {
+            COVER(COVER_READ, address);
+        }
+        if (heatmap_enabled) {
+            HEAT(HEAT_READ, address);
+        }
+    }
     if (address == 0xd011) {
-        if (char_pending) {
+        if (!kb_empty()) {
             return 0x80;
         } else {
+            // The guest is waiting for a key, so show what it has printed
+            if (!output_threaded && (output_head != output_tail)) {
+                flush_output();
+            }
             return 0;
         }
     } else if (address == 0xd010) {
-        uint8_t ch = char_pending;
-        char_pending = 0;
-        return 0x80 | ch;
+        return 0x80 | kb_pop();
+    } else if ((disk_file != NULL) && (address >= DISK_BASE) && (address < DISK_BASE + DISK_REGS)) {
+        return disk_regs[address - DISK_BASE];
+    } else if (hostcall_enabled && (address >= HOSTCALL_BASE) && (address < HOSTCALL_BASE + HOSTCALL_REGS)) {
+        return hostcall_regs[address - HOSTCALL_BASE];
     } else if (((address & 0xff1f) == 0xd012) || ((address & 0xff1f) == 0xd013)) {
-        if (send_ready || reading_file) {
+        if (output_threaded && output_full()) {
+            return 0x80; // Writer thread hasn't caught up yet
+        } else if (send_ready || reading_file) {
             return 0x00; // Allow baud rate regulation
         } else {
             return 0x80;
@@ -775,33 +1547,217 @@ uint8_t read6502(uint16_t address) {
 
 /* Callback from the fake6502 library, handle writes to RAM or the RIOT chips */
 void write6502(uint16_t address, uint8_t value) {
+    if (coverage_enabled) {
+        COVER(COVER_WRITE, address);
+    }
+    if (heatmap_enabled) {
+        HEAT(HEAT_WRITE, address);
+    }
     if ((address & 0xff1f) == 0xd012) {
         if ((reading_file || send_ready) && (value & 0x80)) {
             char ch = value & 0x7f;
             if (ch == CR) {
-                putchar(LF);
+                output_char(LF);
                 curr_col = 0;
             } else if (ch >= SP && ch <= DEL) {
                 if (ch > '_')
                     ch -= 'a' - 'A';
-                putchar(ch);
+                output_char(ch);
                 if ((columns > 0) && (++curr_col >= columns)) {
-                    putchar(LF);
+                    output_char(LF);
                     curr_col = 0;
                 }
             }
-            fflush(stdout);
 
             if (!reading_file && (baud > 0)) {
+                // Simulated baud rates are slow enough to show each char right away
+                flush_output();
                 next_char_time = clock() + baud_clock_ticks;
                 send_ready = false;
             }
         }
+    } else if ((disk_file != NULL) && (address >= DISK_BASE) && (address < DISK_BASE + DISK_REGS)) {
+        if (address == DISK_BASE + DISK_CMD) {
+            disk_command(value);
+        } else if (address != DISK_BASE + DISK_STATUS) {
+            disk_regs[address - DISK_BASE] = value;
+        }
+    } else if (hostcall_enabled && (address >= HOSTCALL_BASE) && (address < HOSTCALL_BASE + HOSTCALL_REGS)) {
+        if (address == HOSTCALL_BASE + HOSTCALL_CALL) {
+            host_call(value);
+        } else if (address != HOSTCALL_BASE + HOSTCALL_STATUS) {
+            hostcall_regs[address - HOSTCALL_BASE] = value;
+        }
     } else if (!rom[address]) { // only write if mem not marked as rom
         ram[address] = value;
     }
 }
 
+/* Opens the disk image for -disk, creating it if it doesn't exist */
+bool open_disk(char *filename) {
+    if (((disk_file = fopen(filename, "r+b")) == NULL) &&
+        ((disk_file = fopen(filename, "w+b")) == NULL)) {
+        printf("Unable to open disk image %s\n", filename);
+        return false;
+    }
+    return true;
+}
+
+/* Runs a disk command, moving the whole transfer between the image and
+ * memory in one go. The block and address registers are left pointing
+ * just past the transfer so the guest can carry on from there. */
+void disk_command(uint8_t command) {
+    static uint8_t buffer[256 * DISK_BLOCK_SIZE];
+    uint32_t block = disk_regs[DISK_BLOCK] | (disk_regs[DISK_BLOCK+1] << 8);
+    uint16_t addr = disk_regs[DISK_ADDR] | (disk_regs[DISK_ADDR+1] << 8);
+    int count = disk_regs[DISK_COUNT] ? disk_regs[DISK_COUNT] : 256;
+    int len = count * DISK_BLOCK_SIZE;
+
+    fseek(disk_file, 0, SEEK_END);
+    long blocks = ftell(disk_file) / DISK_BLOCK_SIZE;
+
+    disk_regs[DISK_STATUS] = DISK_OK;
+    if (command == DISK_SIZE) {
+        if (blocks > DISK_MAX_BLOCKS - 1) {
+            blocks = DISK_MAX_BLOCKS - 1;
+        }
+        disk_regs[DISK_BLOCK] = blocks & 0xff;
+        disk_regs[DISK_BLOCK+1] = blocks >> 8;
+        return;
+    } else if ((command != DISK_READ) && (command != DISK_WRITE)) {
+        disk_regs[DISK_STATUS] = DISK_IO_ERROR;
+        return;
+    } else if ((block + count > DISK_MAX_BLOCKS) ||
+        ((command == DISK_READ) && (block + count > blocks))) {
+        disk_regs[DISK_STATUS] = DISK_RANGE_ERROR;
+        return;
+    }
+
+    fseek(disk_file, (long) block * DISK_BLOCK_SIZE, SEEK_SET);
+    if (command == DISK_READ) {
+        if (fread(buffer, 1, len, disk_file) != len) {
+            disk_regs[DISK_STATUS] = DISK_IO_ERROR;
+            return;
+        }
+        for (int i=0; i < len; i++) {
+            if (!rom[(uint16_t) (addr+i)]) {
+                ram[(uint16_t) (addr+i)] = buffer[i];
+            }
+        }
+    } else {
+        for (int i=0; i < len; i++) {
+            buffer[i] = ram[(uint16_t) (addr+i)];
+        }
+        if ((fwrite(buffer, 1, len, disk_file) != len) || (fflush(disk_file) != 0)) {
+            disk_regs[DISK_STATUS] = DISK_IO_ERROR;
+            return;
+        }
+    }
+    block += count;
+    addr += len;
+    disk_regs[DISK_BLOCK] = block & 0xff;
+    disk_regs[DISK_BLOCK+1] = (block >> 8) & 0xff;
+    disk_regs[DISK_ADDR] = addr & 0xff;
+    disk_regs[DISK_ADDR+1] = addr >> 8;
+}
+
+uint32_t hostcall_get(int reg) {
+    return hostcall_regs[reg] | (hostcall_regs[reg+1] << 8) |
+        (hostcall_regs[reg+2] << 16) | ((uint32_t) hostcall_regs[reg+3] << 24);
+}
+
+void hostcall_set(int reg, uint32_t value) {
+    for (int i=0; i < 4; i++) {
+        hostcall_regs[reg+i] = value >> (8 * i);
+    }
+}
+
+/* Runs a host call function over guest memory. Addresses wrap around at
+ * 64K and ROM is left alone, as it would be by the guest's own code. */
+void host_call(uint8_t function) {
+    uint32_t arg_a = hostcall_get(HOSTCALL_A);
+    uint32_t arg_b = hostcall_get(HOSTCALL_B);
+    uint16_t len = hostcall_get(HOSTCALL_C);
+    uint16_t src = arg_a;
+    uint16_t dest = arg_b;
+
+    hostcall_regs[HOSTCALL_STATUS] = HOSTCALL_OK;
+    switch (function) {
+        case HOSTCALL_MOVE: {
+            static uint8_t buffer[65536];
+            for (int i=0; i < len; i++) {
+                buffer[i] = ram[(uint16_t) (src+i)];
+            }
+            for (int i=0; i < len; i++) {
+                if (!rom[(uint16_t) (dest+i)]) {
+                    ram[(uint16_t) (dest+i)] = buffer[i];
+                }
+            }
+            break;
+        }
+        case HOSTCALL_FILL:
+            for (int i=0; i < len; i++) {
+                if (!rom[(uint16_t) (dest+i)]) {
+                    ram[(uint16_t) (dest+i)] = arg_a;
+                }
+            }
+            break;
+        case HOSTCALL_MUL16:
+            hostcall_set(HOSTCALL_RES1, (arg_a & 0xffff) * (arg_b & 0xffff));
+            break;
+        case HOSTCALL_MUL32: {
+            uint64_t product = (uint64_t) arg_a * arg_b;
+            hostcall_set(HOSTCALL_RES1, product);
+            hostcall_set(HOSTCALL_RES2, product >> 32);
+            break;
+        }
+        case HOSTCALL_DIV16:
+            arg_a &= 0xffff;
+            arg_b &= 0xffff;
+            // Fall through
+        case HOSTCALL_DIV32:
+            if (arg_b == 0) {
+                hostcall_regs[HOSTCALL_STATUS] = HOSTCALL_DIVIDE_BY_ZERO;
+            } else {
+                hostcall_set(HOSTCALL_RES1, arg_a / arg_b);
+                hostcall_set(HOSTCALL_RES2, arg_a % arg_b);
+            }
+            break;
+        case HOSTCALL_COMPARE: {
+            int i = 0;
+            while ((i < len) && (ram[(uint16_t) (src+i)] == ram[(uint16_t) (dest+i)])) {
+                i++;
+            }
+            hostcall_set(HOSTCALL_RES1, i);
+            if (i == len) {
+                hostcall_set(HOSTCALL_RES2, 0);
+            } else {
+                hostcall_set(HOSTCALL_RES2, (ram[(uint16_t) (src+i)] < ram[(uint16_t) (dest+i)]) ? -1 : 1);
+            }
+            break;
+        }
+        case HOSTCALL_SEARCH: {
+            uint16_t find_len = hostcall_get(HOSTCALL_D);
+            hostcall_regs[HOSTCALL_STATUS] = HOSTCALL_NOT_FOUND;
+            for (int i=0; i + find_len <= len; i++) {
+                int j = 0;
+                while ((j < find_len) && (ram[(uint16_t) (src+i+j)] == ram[(uint16_t) (dest+j)])) {
+                    j++;
+                }
+                if (j == find_len) {
+                    hostcall_set(HOSTCALL_RES1, (uint16_t) (src+i));
+                    hostcall_regs[HOSTCALL_STATUS] = HOSTCALL_OK;
+                    break;
+                }
+            }
+            break;
+        }
+        default:
+            hostcall_regs[HOSTCALL_STATUS] = HOSTCALL_BAD_FUNCTION;
+            break;
+    }
+}
+
 int parse_addr_range(char *args, uint16_t *start, uint16_t *end, uint16_t default_size) {
     *start = 0;
     int start_len = 0;
@@ -813,17 +1769,8 @@ int parse_addr_range(char *args, uint16_t *start, uint16_t *end, uint16_t defaul
     int add_to_start = false;
     while (*args) {
         char ch = *args++;
-        if (((ch >= '0') && (ch <= '9')) ||
-            ((ch >= 'a') && (ch <= 'f')) ||
-            ((ch >= 'A') && (ch <= 'F'))) {
-            uint8_t nybble = 0;
-            if ((ch >= '0') && (ch <= '9')) {
-                nybble = ch - '0';
-            } else if ((ch >= 'a') && (ch <= 'f')) {
-                nybble = 10 + ch - 'a';
-            } else if ((ch >= 'A') && (ch <= 'F')) {
-                nybble = 10 + ch - 'A';
-            }
+        if (hex_digit_value(ch) >= 0) {
+            uint8_t nybble = hex_digit_value(ch);
             if (at_start) {
                 if (start_len >= 4) {
                     printf("Too many digits in start address.\n");
@@ -907,14 +1854,248 @@ int parse_addr_range(char *args, uint16_t *start, uint16_t *end, uint16_t defaul
     return 1;
 }
 
+/* Parses a single address for the debugger. An address is a hex
+ * number or @symbol, optionally followed by +/- hex offsets,
+ * e.g. "ffef", "@loop" or "@table+10". */
+int parse_addr_expr(char *args, uint16_t *addr) {
+    uint16_t value = 0;
+    char op = '+';
+
+    while (*args == ' ') args++;
+    if (*args == 0) {
+        printf("Missing address\n");
+        return 0;
+    }
+
+    while (*args) {
+        uint16_t term = 0;
+        if (*args == '@') {
+            char *sym = ++args;
+            while (*args && (*args != '+') && (*args != '-') && (*args != ' ')) args++;
+            char saved = *args;
+            *args = 0;
+            if (!find_symbol(sym, &term)) {
+                printf("Can't find symbol %s\n", sym);
+                *args = saved;
+                return 0;
+            }
+            *args = saved;
+        } else {
+            int digits = 0;
+            while (hex_digit_value(*args) >= 0) {
+                term = (term << 4) + hex_digit_value(*args++);
+                digits++;
+            }
+            if ((digits == 0) || (digits > 4)) {
+                printf("Can't parse address %s\n", args);
+                return 0;
+            }
+        }
+
+        if (op == '+') {
+            value += term;
+        } else {
+            value -= term;
+        }
+
+        while (*args == ' ') args++;
+        if (*args == 0) break;
+        if ((*args != '+') && (*args != '-')) {
+            printf("Invalid character in address: %c\n", *args);
+            return 0;
+        }
+        op = *args++;
+        while (*args == ' ') args++;
+    }
+    *addr = value;
+    return 1;
+}
+
+/* Returns true when one of the stop conditions of a run command has been reached */
+bool debug_stop_reached() {
+    if (breakpoint[pc]) return true;
+    if (debug_count_steps && (debug_steps_left == 0)) return true;
+    if (debug_count_cycles && ((int32_t) (clockticks6502 - debug_cycle_goal) >= 0)) return true;
+
+    // finish stops once an RTS or RTI pops the stack above the depth
+    // it had when finish was entered
+    if (debug_finish && ((debug_last_opcode == 0x60) || (debug_last_opcode == 0x40)) &&
+        (sp > debug_finish_sp)) return true;
+    return false;
+}
+
+/* Executes one instruction while a run command is active */
+void debug_run_step() {
+    debug_last_opcode = ram[pc];
+    if (debug_count_steps) {
+        debug_steps_left--;
+    }
+    step6502();
+}
+
+/* Leaves the prompt and lets the main loop run until a stop condition is hit */
+void debug_resume() {
+    kbhit(true);
+    debug_run_to_breakpoint = true;
+    debug_run_step();
+}
+
+/* Returns addr as hex, followed by the nearest symbol if there is one */
+char *addr_name(uint16_t addr) {
+    static char text[128];
+    char sym[100];
+
+    if (format_symbol(addr, SYMBOL_MAX_OFFSET, sym, sizeof(sym))) {
+        snprintf(text, sizeof(text), "%04x <%s>", addr, sym);
+    } else {
+        snprintf(text, sizeof(text), "%04x", addr);
+    }
+    return text;
+}
+
+#define MAX_SEARCH_PATTERN 64
+#define MAX_SEARCH_RESULTS 256
+
+/* Parses a search pattern of hex bytes, ?? for any byte, a nibble of ?
+ * (like 2?) for half a byte, and "strings". String characters match
+ * with or without bit 7 set, since the Apple-1 uses both.
+ * Returns the pattern length, or 0 if it can't be parsed. */
+int parse_search_pattern(char *text, uint8_t *value, uint8_t *mask) {
+    int len = 0;
+
+    while (*text) {
+        if (*text == ' ') {
+            text++;
+        } else if (*text == '"') {
+            text++;
+            while (*text && (*text != '"')) {
+                if (len == MAX_SEARCH_PATTERN) {
+                    printf("Search pattern is too long\n");
+                    return 0;
+                }
+                value[len] = *text++ & 0x7f;
+                mask[len++] = 0x7f;
+            }
+            if (*text++ != '"') {
+                printf("Missing \" at the end of the string\n");
+                return 0;
+            }
+        } else {
+            if (len == MAX_SEARCH_PATTERN) {
+                printf("Search pattern is too long\n");
+                return 0;
+            }
+            value[len] = 0;
+            mask[len] = 0;
+            for (int i=0; i < 2; i++) {
+                char ch = *text++;
+                value[len] <<= 4;
+                mask[len] <<= 4;
+                if (ch == '?') {
+                    continue;
+                }
+                if (hex_digit_value(ch) < 0) {
+                    printf("Can't parse search byte %.2s\n", text - i - 1);
+                    return 0;
+                }
+                value[len] |= hex_digit_value(ch);
+                mask[len] |= 0xf;
+            }
+            len++;
+        }
+    }
+    return len;
+}
+
+/* f start-end pattern, lists the addresses where pattern appears */
+void search_memory(char *args) {
+    uint8_t value[MAX_SEARCH_PATTERN];
+    uint8_t mask[MAX_SEARCH_PATTERN];
+    uint16_t start, end;
+    char *pattern = strchr(args, ' ');
+
+    if (pattern == NULL) {
+        printf("Usage: f start-end bytes|\"string\"\n");
+        return;
+    }
+    *pattern++ = 0;
+    // The range has to be one word, otherwise f 0300 03ff 20 would
+    // search from 0300 for 03 ff 20
+    if (strpbrk(args, "-.,+") == NULL) {
+        printf("Give the range as start-end, as in f 0300-03ff 20 ef ff\n");
+        return;
+    }
+    if (!parse_addr_range(args, &start, &end, 1)) {
+        return;
+    }
+    int len = parse_search_pattern(pattern, value, mask);
+    if (len == 0) {
+        return;
+    }
+
+    // memchr on a byte that has to match exactly skips most of memory,
+    // only fall back to checking each address when every byte is masked
+    int anchor = -1;
+    for (int i=0; i < len; i++) {
+        if (mask[i] == 0xff) {
+            anchor = i;
+            break;
+        }
+    }
+
+    int found = 0;
+    uint32_t last = end + 1;     // matches have to start before this
+    if (last + len > 65537) {
+        last = 65537 - len;
+    }
+    uint32_t addr = start;
+    while (addr < last) {
+        if (anchor >= 0) {
+            uint8_t *hit = memchr(&ram[addr + anchor], value[anchor], last - addr);
+            if (hit == NULL) break;
+            addr = hit - ram - anchor;
+        }
+        int i = 0;
+        while ((i < len) && ((ram[addr + i] & mask[i]) == value[i])) i++;
+        if (i == len) {
+            if (found == MAX_SEARCH_RESULTS) {
+                printf("Stopping after %d matches\n", MAX_SEARCH_RESULTS);
+                return;
+            }
+            printf("%s\n", addr_name(addr));
+            found++;
+        }
+        addr++;
+    }
+    printf("Found %d matches\n", found);
+}
+
+void set_temp_breakpoint(uint16_t addr) {
+    if (temp_breakpoint >= 0) {
+        breakpoint[temp_breakpoint] = false;
+        printf("Clearing temp breakpoint at %04x\n", temp_breakpoint);
+        temp_breakpoint = -1;
+    }
+    // Don't take over a breakpoint the user set, it would be cleared when hit
+    if (!breakpoint[addr]) {
+        temp_breakpoint = addr;
+        breakpoint[addr] = true;
+    }
+}
+
 void debug_step() {
     char status_str[9];
 
-    if (!breakpoint[pc] && debug_run_to_breakpoint) {
-        step6502();
+    if (debug_run_to_breakpoint && !debug_stop_reached()) {
+        debug_run_step();
         return;
     }
     debug_run_to_breakpoint = false;
+    debug_count_steps = false;
+    debug_count_cycles = false;
+    debug_finish = false;
+
+    flush_output();
 
     status_str[8] = 0;
     status_str[0] = status&0x80 ? 'N' : ' ';
@@ -926,19 +2107,26 @@ void debug_step() {
     status_str[6] = status&0x02 ? 'Z' : ' ';
     status_str[7] = status&0x01 ? 'C' : ' ';
 
-    printf("pc = %04x  a=%02x  x=%02x  y=%02x  sp=%02x  status=%s\n",
+    printf("pc = %04x  a=%02x  x=%02x  y=%02x  sp=%02x  status=%s",
             pc, a, x, y, sp, status_str);
+    uint16_t offset;
+    const char *pc_sym = symbol_at(pc, SYMBOL_MAX_OFFSET, &offset);
+    if (pc_sym != NULL) {
+        printf(offset ? "  in %s+%x" : "  at %s", pc_sym, offset);
+    }
+    printf("\n");
     disassemble(pc, pc+1);
 
     if (pc == temp_breakpoint) {
         breakpoint[pc] = false;
-        temp_breakpoint = 0;
+        temp_breakpoint = -1;
     }
 
     reset_term();
     for (;;) {
         printf("Debug>");
         fgets(input_line, sizeof(input_line)-1, stdin);
+        quit_if_requested();
         int len = strlen(input_line);
         while ((len > 0) && ((input_line[len-1] == '\n') || (input_line[len-1] == '\r'))) {
             input_line[len-1] = 0;
@@ -960,30 +2148,58 @@ void debug_step() {
             args = spacepos;
         }
 
-        if (!strcmp(input_line, "s")) {
+        if (!strcmp(input_line, "s") && (args != NULL)) {
+            unsigned int count;
+            if ((sscanf(args, "%u", &count) != 1) || (count == 0)) {
+                printf("Can't parse step count %s\n", args);
+                continue;
+            }
+            debug_count_steps = true;
+            debug_steps_left = count;
+            debug_resume();
+            return;
+        } else if (!strcmp(input_line, "s")) {
             kbhit(true);
             step6502();
             return;
         } else if (!strcmp(input_line, "n")) {
-            if (temp_breakpoint != 0) {
-                breakpoint[temp_breakpoint] = false;
-                printf("Clearing temp breakpoint at %04x\n", temp_breakpoint);
-            }
-            temp_breakpoint = next_inst_addr(pc);
-            breakpoint[temp_breakpoint] = true;
-            kbhit(true);
-            debug_run_to_breakpoint = true;
-            step6502();
+            set_temp_breakpoint(next_inst_addr(pc));
+            debug_resume();
             return;
         } else if (!strcmp(input_line, "c")) {
-            kbhit(true);
-            debug_run_to_breakpoint = true;
-            step6502();
+            debug_resume();
+            return;
+        } else if (!strcmp(input_line, "cycles")) {
+            unsigned int count;
+            if ((args == NULL) || (sscanf(args, "%u", &count) != 1) || (count == 0)) {
+                printf("cycles command requires a cycle count\n");
+                continue;
+            }
+            debug_count_cycles = true;
+            debug_cycle_goal = clockticks6502 + count;
+            debug_resume();
+            return;
+        } else if (!strcmp(input_line, "until") || !strcmp(input_line, "u")) {
+            uint16_t until_addr;
+            if (args == NULL) {
+                printf("until command requires an address\n");
+                continue;
+            }
+            if (!parse_addr_expr(args, &until_addr)) {
+                continue;
+            }
+            set_temp_breakpoint(until_addr);
+            debug_resume();
+            return;
+        } else if (!strcmp(input_line, "finish")) {
+            debug_finish = true;
+            debug_finish_sp = sp;
+            debug_resume();
             return;
         } else if (!strcmp(input_line, "b")) {
             if (args == NULL) {
                 breakpoint[pc] = true;
-                printf("Set breakpoint at %04x\n", pc);
+                printf("Set breakpoint at %s\n", addr_name(pc));
             } else {
                 if (args[0] == '@') {
                     uint16_t bp_addr;
@@ -991,7 +2207,7 @@ void debug_step() {
                         printf("Can't find symbol %s\n", &args[1]);
                     } else {
                         breakpoint[bp_addr] = true;
-                        printf("Set breakpoint at %04x\n", bp_addr);
+                        printf("Set breakpoint at %s\n", addr_name(bp_addr));
                     }
                 } else {
                     unsigned int bp_addr;
@@ -1000,7 +2216,7 @@ void debug_step() {
                             printf("Breakpoint %0x out of range.\n", bp_addr);
                         } else {
                             breakpoint[bp_addr] = true;
-                            printf("Set breakpoint at %04x\n", bp_addr);
+                            printf("Set breakpoint at %s\n", addr_name(bp_addr));
                         }
                     } else {
                         printf("Can't parse breakpoint addr %s\n", args);
@@ -1011,7 +2227,7 @@ void debug_step() {
             bool found_breakpoint = false;
             for (int i=0; i < 65536; i++) {
                 if (breakpoint[i]) {
-                    printf("%04x\n", i);
+                    printf("%s\n", addr_name(i));
                     found_breakpoint = true;
                 }
             }
@@ -1033,7 +2249,7 @@ void debug_step() {
                         printf("Can't find symbol %s\n", &args[1]);
                     } else {
                         breakpoint[bp_addr] = false;
-                        printf("Cleared breakpoint at %04x\n", bp_addr);
+                        printf("Cleared breakpoint at %s\n", addr_name(bp_addr));
                     }
                 } else {
                     unsigned int bp_addr;
@@ -1042,7 +2258,7 @@ void debug_step() {
                             printf("Breakpoint %0x out of range.\n", bp_addr);
                         } else {
                             breakpoint[bp_addr] = false;
-                            printf("Cleared breakpoint at %04x\n", bp_addr);
+                            printf("Cleared breakpoint at %s\n", addr_name(bp_addr));
                         }
                     } else {
                         printf("Can't parse breakpoint addr %s\n", args);
@@ -1131,6 +2347,125 @@ void debug_step() {
                 }
                 printf("  %s\n", ascii_rep);
             }
+        } else if (!strcmp(input_line, "sym")) {
+            uint16_t sym_addr;
+            if (args == NULL) {
+                printf("sym command requires an address\n");
+            } else if (parse_addr_expr(args, &sym_addr)) {
+                uint16_t offset;
+                const char *name = symbol_at(sym_addr, 0xffff, &offset);
+                if (name == NULL) {
+                    printf("%04x has no symbol at or below it\n", sym_addr);
+                } else if (offset == 0) {
+                    printf("%04x = %s\n", sym_addr, name);
+                } else {
+                    printf("%04x = %s+%x\n", sym_addr, name, offset);
+                }
+            }
+        } else if (!strcmp(input_line, "dis")) {
+            uint16_t start, end;
+            char *filename = NULL;
+            if (args != NULL) {
+                filename = strrchr(args, ' ');
+            }
+            if (filename == NULL) {
+                printf("Usage: dis start end file\n");
+            } else {
+                *filename++ = 0;
+                if (parse_addr_range(args, &start, &end, 1)) {
+                    uint16_t entry = pc;
+                    write_disassembly(filename, start, end, &entry, 1);
+                }
+            }
+        } else if (!strcmp(input_line, "f")) {
+            if (args == NULL) {
+                printf("Usage: f start-end bytes|\"string\"\n");
+            } else {
+                search_memory(args);
+            }
+        } else if (!strcmp(input_line, "refs")) {
+            uint16_t target, start = 0, end = 0xffff;
+            char *range = NULL;
+            if (args != NULL) {
+                range = strchr(args, ' ');
+                if (range != NULL) *range++ = 0;
+            }
+            if (args == NULL) {
+                printf("Usage: refs addr [start-end]\n");
+            } else if (parse_addr_expr(args, &target) &&
+                       ((range == NULL) || parse_addr_range(range, &start, &end, 1))) {
+                printf("Found %d references\n", find_references(target, start, end));
+            }
+        } else if (!strcmp(input_line, "snap")) {
+            if (args == NULL) {
+                list_snapshots();
+            } else if (args[0] == '-') {
+                delete_snapshot(&args[1]);
+            } else {
+                take_snapshot(args);
+            }
+        } else if (!strcmp(input_line, "diff")) {
+            char *new_name = NULL;
+            if (args != NULL) {
+                new_name = strchr(args, ' ');
+                if (new_name != NULL) *new_name++ = 0;
+            }
+            if (args == NULL) {
+                printf("Usage: diff snapshot [snapshot]\n");
+            } else {
+                diff_snapshots(args, new_name);
+            }
+        } else if (!strcmp(input_line, "cov")) {
+            if (!coverage_enabled) {
+                printf("Start the emulator with -coverage file to record coverage\n");
+            } else if (args == NULL) {
+                print_coverage_summary("Coverage");
+            } else if (save_coverage(args)) {
+                print_coverage_summary(args);
+            }
+        } else if (!strcmp(input_line, "heat")) {
+            if (!heatmap_enabled) {
+                printf("Start the emulator with -heatmap name to count accesses\n");
+            } else if (args == NULL) {
+                printf("Usage: heat name.ppm|name.png\n");
+            } else {
+                save_heatmaps(args);
+            }
+        } else if (!strcmp(input_line, "stats")) {
+            if (!statsenabled6502) {
+                printf("Start the emulator with -stats file to count instructions\n");
+            } else {
+                write_stats(args != NULL ? args : "-");
+            }
+        } else if (!strcmp(input_line, "stack")) {
+            if ((args != NULL) && !strcmp(args, "reset")) {
+                stacklow6502 = sp;
+                stacklowpc6502 = pc;
+                memset(calldepth6502, 0, sizeof(calldepth6502));
+                stack_overflows = 0;
+                stack_underflows = 0;
+                printf("Stack marks reset\n");
+            } else {
+                stack_report();
+            }
+        } else if (!strcmp(input_line, "basic")) {
+            save_basic(args != NULL ? args : "-");
+        } else if (!strcmp(input_line, "image")) {
+            uint16_t start, end;
+            char *filename = NULL;
+            if (args != NULL) {
+                filename = strrchr(args, ' ');
+            }
+            if (filename == NULL) {
+                printf("Usage: image start end file\n");
+            } else {
+                *filename++ = 0;
+                if (parse_addr_range(args, &start, &end, 1)) {
+                    if (save_image(filename, start, end)) {
+                        printf("Saved %04x-%04x to %s\n", start, end, filename);
+                    }
+                }
+            }
         } else if (!strcmp(input_line, "end")) {
             printf("End debugging mode.\n");
             debugging = false;
@@ -1141,133 +2476,35 @@ void debug_step() {
             printf("Debugging commands:\n");
             printf("s or <return> - step to next instruction\n");
             printf("n - step over next instruction (useful to not follow subroutines)\n");
+            printf("s count - run count instructions, stopping early at a breakpoint\n");
             printf("c - continue running until a breakpoint is reached\n");
+            printf("cycles count - run for count clock cycles\n");
+            printf("until addr or u addr - run until pc reaches addr (hex, @sym, @sym+offset)\n");
+            printf("finish - run until the current subroutine returns\n");
             printf("b [addr]  - set breakpoint at address (addr defaults to pc)\n");
             printf("cb [addr]  - set breakpoint at address (addr defaults to pc)\n");
             printf("ca - clear all breakpoints\n");
             printf("lb - list breakpoints\n");
+            printf("sym addr - show the nearest symbol at or below addr\n");
             printf("d start [end] - disassemble starting at start, with optional end addr\n");
+            printf("dis start end file - write start-end to file, split into code and data\n");
+            printf("f start-end pattern - find hex bytes, ?? or 2? wildcards, or \"text\" in memory\n");
+            printf("refs addr [start-end] - find instructions that use addr\n");
+            printf("snap [name] - save memory and registers as snapshot name, or list snapshots\n");
+            printf("snap -name - delete snapshot name\n");
+            printf("diff name [name2] - show what changed between snapshots, or since name\n");
+            printf("cov [file] - show how much has been covered, or save coverage to file\n");
+            printf("heat name - write heatmaps of the accesses counted so far\n");
+            printf("stats [file] - show the instruction statistics so far, or write them to file\n");
+            printf("stack [reset] - show the stack depth high water mark and deepest calls\n");
             printf("m start [end] - display memory starting at start, with optional end addr\n");
+            printf("image start end file - save memory as a binary image for -rom or -ram\n");
+            printf("basic [file] - list the Woz BASIC program, or save it to file\n");
+            printf("The end address of d and m is just past the last byte shown, dis, f, refs and\n");
+            printf("image include the byte at end.\n");
             printf("end - stop debugging\n");
             printf("h or help - this listing\n");
             continue;
         }
     }
 }
-
-enum addressing_modes {
-    IMM, ABS, ABS_X, ABS_Y, ZP, ZP_X, IND, IND_X, IND_Y, REL, ACC, NONE
-};
-
-struct instruction {
-    char *opcode;
-    uint16_t addr_mode;
-};
-
-const struct instruction ILLEGAL = { "???", NONE };
-
-struct instruction instruction_desc[] = {
-/* 0 */    { "brk", NONE }, {"ora", IND_X}, ILLEGAL, ILLEGAL, ILLEGAL, {"ora", ZP}, {"asl", ZP}, ILLEGAL, {"php", NONE}, {"ora", IMM}, {"asl", ACC}, ILLEGAL, ILLEGAL, {"ora", ABS}, {"asl", ABS}, ILLEGAL,
-/* 1 */    { "bpl", REL}, {"ora", IND_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"ora", ZP_X}, {"asl", ZP_X}, ILLEGAL, {"clc", NONE}, {"ora", ABS_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"ora", ABS_X}, {"asl", ABS_X}, ILLEGAL,
-/* 2 */    { "jsr", ABS}, {"and", IND_X}, ILLEGAL, ILLEGAL, {"bit", ZP}, {"and", ZP}, {"rol", ZP}, ILLEGAL, {"plp", NONE}, {"and", IMM}, {"rol", ACC}, ILLEGAL, {"bit", ABS}, {"and", ABS}, {"rol", ABS}, ILLEGAL,
-/* 3 */    { "bmi", REL}, {"and", IND_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"and", ZP_X}, {"rol", ZP_X}, ILLEGAL, {"sec", NONE}, {"and",ABS_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"and", ABS_X}, {"rol", ABS_X}, ILLEGAL,
-/* 4 */    { "rti", NONE}, {"eor", IND_X}, ILLEGAL, ILLEGAL, ILLEGAL, {"eor", ZP}, {"lsr", ZP}, ILLEGAL, {"pha", NONE}, {"eor", IMM}, {"lsr", ACC}, ILLEGAL, {"jmp", ABS}, {"eor", ABS}, {"lsr", ABS}, ILLEGAL,
-/* 5 */    { "bvc", REL}, {"eor", IND_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"eor", ZP_X}, {"lsr", ZP_X}, ILLEGAL, {"cli", NONE}, {"eor", ABS_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"eor", ABS_X}, {"lsr", ABS_X}, ILLEGAL,
-/* 6 */    {"rts", NONE}, {"adc", IND_X}, ILLEGAL, ILLEGAL, ILLEGAL, {"adc", ZP}, {"ror", ZP}, ILLEGAL, {"pla", NONE}, {"adc", IMM}, {"ror", ACC}, ILLEGAL, {"jmp",IND}, {"adc", ABS}, {"ror", ABS}, ILLEGAL,
-/* 7 */    {"bvs", REL}, {"adc",IND_Y}, ILLEGAL, ILLEGAL, ILLEGAL, {"adc",ZP_X}, {"ror", ZP_X}, ILLEGAL, {"sei", NONE}, {"adc", ABS_Y},ILLEGAL, ILLEGAL, ILLEGAL, {"adc",ABS_X}, {"ror",ABS_X}, ILLEGAL,
-/* 8 */     ILLEGAL, {"sta",IND_X}, ILLEGAL, ILLEGAL, {"sty",ZP}, {"sta",ZP}, {"stx",ZP}, ILLEGAL, {"dey",NONE}, ILLEGAL,{"txa", NONE}, ILLEGAL, {"sty",ABS},{"sta",ABS},{"stx",ABS}, ILLEGAL,
-/* 9 */     {"bcc", REL}, {"sta", IND_Y}, ILLEGAL, ILLEGAL, {"sty",ZP_X}, {"sta",ZP_X}, {"stx",ZP_X}, ILLEGAL, {"tya", NONE}, {"sta",ABS_Y}, {"txs",NONE},  ILLEGAL, ILLEGAL, {"sta",ABS_X}, ILLEGAL, ILLEGAL,
-/* a */     {"ldy",IMM}, {"lda",IND_X},{"ldx",IMM}, ILLEGAL,{"ldy",ZP},{"lda",ZP},{"ldx",ZP}, ILLEGAL, {"tay", NONE}, {"lda", IMM}, {"tax", NONE},  ILLEGAL, {"ldy",ABS}, {"lda",ABS}, {"ldx",ABS},  ILLEGAL,
-/* b */     {"bcs",REL},{"lda",IND_Y}, ILLEGAL, ILLEGAL,{"ldy",ZP_X},{"lda",ZP_X},{"ldx",ZP_X}, ILLEGAL,{"clv",NONE},{"lda",ABS_Y},{"tsx",NONE}, ILLEGAL,{"ldy",ABS_X},{"lda",ABS_X},{"ldy",ABS_Y}, ILLEGAL,
-/* c */     {"cpy",IMM},{"cmp",IND_X}, ILLEGAL, ILLEGAL,{"cpy",ZP},{"cmp",ZP},{"dec",ZP}, ILLEGAL, {"iny",NONE},{"cmp",IMM},{"dex",NONE}, ILLEGAL,{"cpy",ABS},{"cmp",ABS},{"dec",ABS},ILLEGAL,
-/* d */     {"bne",REL},{"cmp",IND_Y},ILLEGAL, ILLEGAL, ILLEGAL,{"cmp",ZP_X},{"dec",ZP_X}, ILLEGAL,{"cld",NONE},{"cmp",ABS_Y},ILLEGAL, ILLEGAL, ILLEGAL, {"cmp",ABS_X},{"dec",ABS_X}, ILLEGAL,
-/* e */     {"cpx",IMM},{"sbc",IND_X}, ILLEGAL, ILLEGAL,{"cpx",ZP},{"sbc",ZP},{"inc",ZP}, ILLEGAL,{"inx",NONE},{"sbc",IMM},{"nop",NONE}, ILLEGAL,{"cpx",ABS},{"sbc",ABS},{"inc",ABS}, ILLEGAL,
-/* f */     {"beq",REL},{"sbc",IND_Y},ILLEGAL, ILLEGAL, ILLEGAL,{"sbc",ZP_X},{"inc",ZP_X}, ILLEGAL,{"sed",NONE},{"sbc",ABS_Y},ILLEGAL, ILLEGAL, ILLEGAL,{"sbc",ABS_X},{"inc",ABS_X}, ILLEGAL
-};
-
-uint16_t instruction_size(uint8_t addr_mode) {
-    switch (addr_mode) {
-        case ABS:
-        case ABS_X:
-        case ABS_Y:
-            return 3;
-        case ZP:
-        case ZP_X:
-        case IND:
-        case IND_X:
-        case IND_Y:
-        case IMM:
-        case REL:
-            return 2;
-        case NONE:
-        case ACC:
-            return 1;
-    }
-}
-
-uint16_t next_inst_addr(uint16_t loc) {
-    uint8_t opcode = ram[loc];
-    struct instruction inst = instruction_desc[opcode];
-    uint8_t addr_mode = inst.addr_mode;
-    return loc + instruction_size(addr_mode);
-}
-
-void disassemble(uint16_t from, uint16_t to) {
-    while (from < to) {
-        uint8_t opcode = ram[from];
-        struct instruction inst = instruction_desc[opcode];
-        uint8_t addr_mode = inst.addr_mode;
-        uint8_t inst_size = instruction_size(addr_mode);
-
-        printf("%04x: ", from);
-        for (int i=0; i <= 2; i++) {
-            if (i >= inst_size) {
-                printf("   ");
-            } else {
-                printf("%02x ", ram[from+i]);
-            }
-        }
-        printf(" %3.3s", inst.opcode);
-
-        switch (addr_mode) {
-            case ABS:
-                printf(" $%04x\n", ram[from+1]+(ram[from+2]<<8));
-                break;
-            case ABS_X:
-                printf(" $%04x,X\n", ram[from+1]+(ram[from+2]<<8));
-                break;
-            case ABS_Y:
-                printf(" $%04x,Y\n", ram[from+1]+(ram[from+2]<<8));
-                break;
-            case ZP:
-                printf(" $%02x\n", ram[from+1]);
-                break;
-            case ZP_X:
-                printf(" $%02x,X\n", ram[from+1]);
-                break;
-            case IND:
-                printf(" ($%02x)\n", ram[from+1]);
-                break;
-            case IND_X:
-                printf(" ($%02x,X)\n", ram[from+1]);
-                break;
-            case IND_Y:
-                printf(" ($%02x),Y\n", ram[from+1]);
-                break;
-            case IMM:
-                printf(" #$%02x\n", ram[from+1]);
-                break;
-            case REL:
-                printf(" $%04x\n", from+2+(char)ram[from+1]);
-                break;
-            case NONE:
-                printf("\n");
-                break;
-            case ACC:
-                printf(" A\n");
-                break;
-        }
-
-        from += inst_size;
-    }
-}
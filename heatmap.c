@@ -0,0 +1,200 @@
+/* Counts of how often each address is executed, read and written, and
+ * heatmap images of them.
+ *
+ * Each image is 256x256 with a pixel per address, a row per page, so
+ * page 00 is the top row and FFxx the bottom. Counts are shown on a log
+ * scale from black (never) through red and yellow to white (the most
+ * used address in that image). Images are written as binary PPM, or as
+ * PNG when the name ends in .png. The PNG uses uncompressed deflate
+ * blocks, so no compression library is needed.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#define HEAT_EXEC 0
+#define HEAT_READ 1
+#define HEAT_WRITE 2
+#define HEAT_MAPS 3
+
+#define IMAGE_SIZE 256
+#define ROW_BYTES (1 + IMAGE_SIZE * 3)  // PNG rows start with a filter byte
+
+bool heatmap_enabled = false;
+uint32_t heat[HEAT_MAPS][65536];
+
+static char *heatmap_name = NULL;
+static const char *map_names[HEAT_MAPS] = { "exec", "read", "write" };
+
+/* Black to red to yellow to white as level goes from 0 to 1 */
+static void heat_color(double level, uint8_t *rgb) {
+    double scaled = level * 3;
+    for (int i=0; i < 3; i++) {
+        double part = scaled - i;
+        rgb[i] = (part <= 0) ? 0 : (part >= 1) ? 255 : (uint8_t) (part * 255);
+    }
+}
+
+/* Fills pixels with the image for one map, as PNG rows with a filter
+ * byte of 0 in front of each row */
+static void make_image(int map, uint8_t *pixels) {
+    uint32_t max = 0;
+    for (int i=0; i < 65536; i++) {
+        if (heat[map][i] > max) max = heat[map][i];
+    }
+    double scale = (max > 0) ? 1.0 / log((double) max + 1) : 0;
+
+    for (int row=0; row < IMAGE_SIZE; row++) {
+        uint8_t *p = pixels + row * ROW_BYTES;
+        *p++ = 0;
+        for (int col=0; col < IMAGE_SIZE; col++) {
+            uint32_t count = heat[map][row * IMAGE_SIZE + col];
+            if (count == 0) {
+                p[0] = p[1] = p[2] = 0;
+            } else {
+                // Keep used addresses visible even next to very hot ones
+                double level = log((double) count + 1) * scale;
+                heat_color(0.1 + 0.9 * level, p);
+            }
+            p += 3;
+        }
+    }
+}
+
+static void put_be32(uint8_t *p, uint32_t value) {
+    p[0] = value >> 24;
+    p[1] = value >> 16;
+    p[2] = value >> 8;
+    p[3] = value;
+}
+
+static uint32_t crc32(uint32_t crc, const uint8_t *data, size_t len) {
+    static uint32_t table[256];
+    static bool table_ready = false;
+
+    if (!table_ready) {
+        for (uint32_t i=0; i < 256; i++) {
+            uint32_t c = i;
+            for (int bit=0; bit < 8; bit++) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[i] = c;
+        }
+        table_ready = true;
+    }
+    crc = ~crc;
+    for (size_t i=0; i < len; i++) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void write_chunk(FILE *out, const char *type, const uint8_t *data, uint32_t len) {
+    uint8_t header[8];
+    uint8_t crc_bytes[4];
+
+    put_be32(header, len);
+    memcpy(header+4, type, 4);
+    uint32_t crc = crc32(crc32(0, header+4, 4), data, len);
+    put_be32(crc_bytes, crc);
+    fwrite(header, 1, sizeof(header), out);
+    fwrite(data, 1, len, out);
+    fwrite(crc_bytes, 1, sizeof(crc_bytes), out);
+}
+
+static void write_png(FILE *out, const uint8_t *pixels) {
+    static uint8_t zdata[2 + IMAGE_SIZE * (5 + ROW_BYTES) + 4];
+    uint8_t ihdr[13];
+    uint8_t *p = zdata;
+    uint32_t adler_a = 1, adler_b = 0;
+
+    fwrite("\x89PNG\r\n\x1a\n", 1, 8, out);
+    put_be32(ihdr, IMAGE_SIZE);
+    put_be32(ihdr+4, IMAGE_SIZE);
+    ihdr[8] = 8;        // bits per channel
+    ihdr[9] = 2;        // RGB
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    write_chunk(out, "IHDR", ihdr, sizeof(ihdr));
+
+    // A zlib stream of stored blocks, one per row
+    *p++ = 0x78;
+    *p++ = 0x01;
+    for (int row=0; row < IMAGE_SIZE; row++) {
+        const uint8_t *data = pixels + row * ROW_BYTES;
+        *p++ = (row == IMAGE_SIZE - 1) ? 1 : 0;
+        p[0] = ROW_BYTES & 0xff;
+        p[1] = ROW_BYTES >> 8;
+        p[2] = ~ROW_BYTES & 0xff;
+        p[3] = (~ROW_BYTES >> 8) & 0xff;
+        p += 4;
+        memcpy(p, data, ROW_BYTES);
+        p += ROW_BYTES;
+        for (int i=0; i < ROW_BYTES; i++) {
+            adler_a = (adler_a + data[i]) % 65521;
+            adler_b = (adler_b + adler_a) % 65521;
+        }
+    }
+    put_be32(p, (adler_b << 16) | adler_a);
+    p += 4;
+    write_chunk(out, "IDAT", zdata, p - zdata);
+    write_chunk(out, "IEND", NULL, 0);
+}
+
+static void write_ppm(FILE *out, const uint8_t *pixels) {
+    fprintf(out, "P6\n%d %d\n255\n", IMAGE_SIZE, IMAGE_SIZE);
+    for (int row=0; row < IMAGE_SIZE; row++) {
+        fwrite(pixels + row * ROW_BYTES + 1, 1, ROW_BYTES - 1, out);
+    }
+}
+
+/* Writes name-exec, name-read and name-write images, where the kind of
+ * access goes before the .ppm or .png extension */
+int save_heatmaps(char *name) {
+    static uint8_t pixels[IMAGE_SIZE * ROW_BYTES];
+    char *ext = strrchr(name, '.');
+    char *slash = strrchr(name, '/');
+    if ((ext != NULL) && (slash != NULL) && (ext < slash)) {
+        ext = NULL;     // the dot is in a directory name
+    }
+    bool png = (ext != NULL) && !strcasecmp(ext, ".png");
+    int base_len = (ext != NULL) ? ext - name : strlen(name);
+
+    for (int map=0; map < HEAT_MAPS; map++) {
+        char filename[1024];
+        FILE *out;
+
+        snprintf(filename, sizeof(filename), "%.*s-%s%s", base_len, name, map_names[map],
+            (ext != NULL) ? ext : ".ppm");
+        if ((out = fopen(filename, "wb")) == NULL) {
+            fprintf(stderr, "Can't open file %s\n", filename);
+            return 0;
+        }
+        make_image(map, pixels);
+        if (png) {
+            write_png(out, pixels);
+        } else {
+            write_ppm(out, pixels);
+        }
+        if (fclose(out) != 0) {
+            fprintf(stderr, "Unable to write %s\n", filename);
+            return 0;
+        }
+        printf("Wrote %s\n", filename);
+    }
+    return 1;
+}
+
+static void save_heatmaps_at_exit() {
+    save_heatmaps(heatmap_name);
+}
+
+/* Turns on counting for -heatmap, saving the images when froot1 exits */
+void start_heatmap(char *name) {
+    heatmap_name = name;
+    heatmap_enabled = true;
+    atexit(save_heatmaps_at_exit);
+}
@@ -0,0 +1,243 @@
+/* Binary memory images, and the cache of parsed ROM files.
+ *
+ * An image is a header followed by one or more segments, all numbers
+ * low byte first:
+ *   header  - "F1MI", version (2 bytes), segment count (2 bytes),
+ *             checksum (4 bytes), reserved (4 bytes)
+ *   segment - address (2 bytes), flags (2 bytes), length (4 bytes), data
+ * The checksum is a 32-bit FNV-1a hash of everything after the header.
+ * A segment with IMAGE_ROM set is loaded as ROM when the image is loaded
+ * with -rom, loading with -ram always makes it RAM.
+ *
+ * Text ROM files that have been parsed once are saved as images in the
+ * cache directory, named by a hash of the text, so the next load only
+ * has to copy the image into memory.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+extern uint8_t ram[65536];
+extern bool rom[65536];
+
+#define IMAGE_MAGIC "F1MI"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER_SIZE 16
+#define SEGMENT_HEADER_SIZE 8
+#define IMAGE_ROM 0x0001
+
+static uint32_t get_le(const uint8_t *p, int bytes) {
+    uint32_t value = 0;
+    for (int i=bytes-1; i >= 0; i--) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void put_le(uint8_t *p, uint32_t value, int bytes) {
+    for (int i=0; i < bytes; i++) {
+        p[i] = value >> (8 * i);
+    }
+}
+
+static uint32_t fnv32(const uint8_t *data, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i=0; i < len; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint64_t hash_bytes(const uint8_t *data, size_t len) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i=0; i < len; i++) {
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+/* Maps a whole file into memory, returns NULL if it is empty or can't
+ * be mapped */
+uint8_t *map_file(int fd, size_t *len) {
+    struct stat st;
+
+    if ((fstat(fd, &st) != 0) || (st.st_size == 0)) {
+        return NULL;
+    }
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return NULL;
+    }
+    *len = st.st_size;
+    return data;
+}
+
+bool is_image(const uint8_t *data, size_t len) {
+    return (len >= IMAGE_HEADER_SIZE) && !memcmp(data, IMAGE_MAGIC, 4);
+}
+
+/* Loads an image that is already in memory (usually mmapped). The whole
+ * image is checked before anything is copied, so a bad image leaves
+ * memory alone. */
+int load_image(const uint8_t *data, size_t len, bool read_only, char *filename) {
+    if (!is_image(data, len)) {
+        fprintf(stderr, "%s is not a memory image\n", filename);
+        return 0;
+    }
+    if (get_le(data+4, 2) != IMAGE_VERSION) {
+        fprintf(stderr, "%s is an unsupported image version %d\n", filename, get_le(data+4, 2));
+        return 0;
+    }
+    if (fnv32(data + IMAGE_HEADER_SIZE, len - IMAGE_HEADER_SIZE) != get_le(data+8, 4)) {
+        fprintf(stderr, "Bad checksum in image %s\n", filename);
+        return 0;
+    }
+
+    int segments = get_le(data+6, 2);
+    size_t pos = IMAGE_HEADER_SIZE;
+    for (int i=0; i < segments; i++) {
+        if (pos + SEGMENT_HEADER_SIZE > len) {
+            fprintf(stderr, "Image %s is truncated\n", filename);
+            return 0;
+        }
+        uint32_t addr = get_le(data+pos, 2);
+        uint32_t seg_len = get_le(data+pos+4, 4);
+        if ((addr + seg_len > 65536) || (pos + SEGMENT_HEADER_SIZE + seg_len > len)) {
+            fprintf(stderr, "Bad segment at %04x in image %s\n", addr, filename);
+            return 0;
+        }
+        pos += SEGMENT_HEADER_SIZE + seg_len;
+    }
+
+    pos = IMAGE_HEADER_SIZE;
+    for (int i=0; i < segments; i++) {
+        uint32_t addr = get_le(data+pos, 2);
+        bool seg_rom = read_only && (get_le(data+pos+2, 2) & IMAGE_ROM);
+        uint32_t seg_len = get_le(data+pos+4, 4);
+        memcpy(&ram[addr], data + pos + SEGMENT_HEADER_SIZE, seg_len);
+        memset(&rom[addr], seg_rom, seg_len);
+        pos += SEGMENT_HEADER_SIZE + seg_len;
+    }
+    return 1;
+}
+
+/* Writes the addresses marked in include as an image, with a segment for
+ * each run of addresses that are all ROM or all RAM. The image is written
+ * to a temporary file first so a reader never sees half of it. */
+static int write_image(char *filename, bool *include, bool *is_rom) {
+    static uint8_t image[IMAGE_HEADER_SIZE + 65536 * (SEGMENT_HEADER_SIZE + 1)];
+    size_t len = IMAGE_HEADER_SIZE;
+    int segments = 0;
+
+    for (uint32_t addr=0; addr < 65536; ) {
+        if (!include[addr]) {
+            addr++;
+            continue;
+        }
+        uint32_t end = addr;
+        while ((end < 65536) && include[end] && (is_rom[end] == is_rom[addr])) {
+            end++;
+        }
+        put_le(image+len, addr, 2);
+        put_le(image+len+2, is_rom[addr] ? IMAGE_ROM : 0, 2);
+        put_le(image+len+4, end - addr, 4);
+        memcpy(image + len + SEGMENT_HEADER_SIZE, &ram[addr], end - addr);
+        len += SEGMENT_HEADER_SIZE + end - addr;
+        segments++;
+        addr = end;
+    }
+
+    memcpy(image, IMAGE_MAGIC, 4);
+    put_le(image+4, IMAGE_VERSION, 2);
+    put_le(image+6, segments, 2);
+    put_le(image+8, fnv32(image + IMAGE_HEADER_SIZE, len - IMAGE_HEADER_SIZE), 4);
+    put_le(image+12, 0, 4);
+
+    char temp_name[1024];
+    snprintf(temp_name, sizeof(temp_name), "%s.%d", filename, (int) getpid());
+    FILE *out;
+    if ((out = fopen(temp_name, "wb")) == NULL) {
+        return 0;
+    }
+    bool ok = fwrite(image, 1, len, out) == len;
+    ok = (fclose(out) == 0) && ok;
+    if (!ok || (rename(temp_name, filename) != 0)) {
+        unlink(temp_name);
+        return 0;
+    }
+    return 1;
+}
+
+/* Saves start-end as an image, keeping track of which parts are ROM */
+int save_image(char *filename, uint16_t start, uint16_t end) {
+    static bool include[65536];
+
+    memset(include, 0, sizeof(include));
+    for (uint32_t addr=start; addr <= end; addr++) {
+        include[addr] = true;
+    }
+    if (!write_image(filename, include, rom)) {
+        fprintf(stderr, "Unable to write image %s\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+/* The cache lives in $XDG_CACHE_HOME/froot-1 or ~/.cache/froot-1 */
+static bool cache_file_name(uint64_t hash, char *name, int size, bool create) {
+    char *cache_home = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    char dir[900];
+
+    if ((cache_home != NULL) && (cache_home[0] != 0)) {
+        snprintf(dir, sizeof(dir), "%s/froot-1", cache_home);
+    } else if (home != NULL) {
+        snprintf(dir, sizeof(dir), "%s/.cache", home);
+        if (create) mkdir(dir, 0755);
+        snprintf(dir, sizeof(dir), "%s/.cache/froot-1", home);
+    } else {
+        return false;
+    }
+    if (create) mkdir(dir, 0755);
+    snprintf(name, size, "%s/%016llx.img", dir, (unsigned long long) hash);
+    return true;
+}
+
+/* Loads the cached image of a text ROM with this hash, if there is one.
+ * Returns false if there isn't a usable one, without changing memory. */
+bool load_cached_rom(uint64_t hash, bool read_only) {
+    char name[1024];
+    FILE *in;
+    size_t len;
+
+    if (!cache_file_name(hash, name, sizeof(name), false) ||
+        ((in = fopen(name, "rb")) == NULL)) {
+        return false;
+    }
+    uint8_t *image = map_file(fileno(in), &len);
+    fclose(in);
+    if (image == NULL) {
+        return false;
+    }
+    // The cached images only have ROM segments, so read_only decides
+    bool loaded = is_image(image, len) && load_image(image, len, read_only, name);
+    munmap(image, len);
+    return loaded;
+}
+
+/* Saves the addresses a text ROM loaded into the cache. Failing to write
+ * the cache isn't an error, the ROM just gets parsed again next time. */
+void save_cached_rom(uint64_t hash, bool *loaded) {
+    static bool all_rom[65536];
+    char name[1024];
+
+    memset(all_rom, true, sizeof(all_rom));
+    if (cache_file_name(hash, name, sizeof(name), true)) {
+        write_image(name, loaded, all_rom);
+    }
+}
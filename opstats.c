@@ -0,0 +1,129 @@
+/* Instruction mix statistics, counted by fake6502 while -stats is on.
+ *
+ * The report lists each opcode that ran with its share of instructions
+ * and cycles, how often an indexed access crossed a page and how many
+ * of those cost an extra cycle, and how often branches were taken and
+ * crossed a page. Totals by addressing mode and for all branches follow.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern uint8_t statsenabled6502;
+extern uint64_t opcount6502[256], opcycles6502[256], pagecross6502[256], penalty6502[256];
+extern uint64_t branchtaken6502[256], branchpage6502[256];
+extern uint64_t instructions;
+
+const char *opcode_name(uint8_t);
+const char *opcode_mode_name(uint8_t);
+
+static char *stats_file_name = NULL;
+
+static double percent(uint64_t part, uint64_t whole) {
+    return (whole > 0) ? 100.0 * part / whole : 0;
+}
+
+static int compare_counts(const void *a, const void *b) {
+    uint64_t count_a = opcount6502[*(const uint8_t *) a];
+    uint64_t count_b = opcount6502[*(const uint8_t *) b];
+    return (count_a < count_b) ? 1 : (count_a > count_b) ? -1 : 0;
+}
+
+static void write_report(FILE *out) {
+    uint8_t order[256];
+    uint64_t total = 0, total_cycles = 0;
+
+    for (int i=0; i < 256; i++) {
+        order[i] = i;
+        total += opcount6502[i];
+        total_cycles += opcycles6502[i];
+    }
+    qsort(order, 256, 1, compare_counts);
+
+    fprintf(out, "%llu instructions counted, %llu cycles, %llu executed in all\n",
+        (unsigned long long) total, (unsigned long long) total_cycles,
+        (unsigned long long) instructions);
+    fprintf(out, "op  instruction       count   %%inst  %%cycle  pagecross   penalty     taken  takenpage\n");
+    for (int i=0; (i < 256) && (opcount6502[order[i]] > 0); i++) {
+        int op = order[i];
+        char name[32];
+        snprintf(name, sizeof(name), "%s %s", opcode_name(op), opcode_mode_name(op));
+        fprintf(out, "%02x  %-12s %10llu  %5.2f%%  %5.2f%%  %9llu %9llu", op, name,
+            (unsigned long long) opcount6502[op], percent(opcount6502[op], total),
+            percent(opcycles6502[op], total_cycles),
+            (unsigned long long) pagecross6502[op], (unsigned long long) penalty6502[op]);
+        if (!strcmp(opcode_mode_name(op), "rel")) {
+            fprintf(out, " %9llu  %9llu", (unsigned long long) branchtaken6502[op],
+                (unsigned long long) branchpage6502[op]);
+        }
+        fprintf(out, "\n");
+    }
+
+    // Totals by addressing mode, in the order the modes first appear above
+    fprintf(out, "\nmode         count   %%inst  %%cycle  pagecross   penalty\n");
+    bool done[256];
+    memset(done, 0, sizeof(done));
+    for (int i=0; (i < 256) && (opcount6502[order[i]] > 0); i++) {
+        const char *mode = opcode_mode_name(order[i]);
+        if (done[i]) continue;
+        uint64_t count = 0, cycles = 0, crosses = 0, penalties = 0;
+        for (int j=i; j < 256; j++) {
+            if (!done[j] && !strcmp(opcode_mode_name(order[j]), mode)) {
+                count += opcount6502[order[j]];
+                cycles += opcycles6502[order[j]];
+                crosses += pagecross6502[order[j]];
+                penalties += penalty6502[order[j]];
+                done[j] = true;
+            }
+        }
+        fprintf(out, "%-8s %10llu  %5.2f%%  %5.2f%%  %9llu %9llu\n", mode,
+            (unsigned long long) count, percent(count, total), percent(cycles, total_cycles),
+            (unsigned long long) crosses, (unsigned long long) penalties);
+    }
+
+    uint64_t branches = 0, taken = 0, taken_page = 0;
+    for (int op=0; op < 256; op++) {
+        if (!strcmp(opcode_mode_name(op), "rel")) {
+            branches += opcount6502[op];
+            taken += branchtaken6502[op];
+            taken_page += branchpage6502[op];
+        }
+    }
+    fprintf(out, "\nBranches: %llu, taken %llu (%.2f%%), taken to another page %llu (%.2f%%)\n",
+        (unsigned long long) branches, (unsigned long long) taken, percent(taken, branches),
+        (unsigned long long) taken_page, percent(taken_page, branches));
+}
+
+/* Writes the report to filename, or stdout for - */
+int write_stats(char *filename) {
+    FILE *out;
+
+    if (!strcmp(filename, "-")) {
+        write_report(stdout);
+        return 1;
+    }
+    if ((out = fopen(filename, "w")) == NULL) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        return 0;
+    }
+    write_report(out);
+    if (fclose(out) != 0) {
+        fprintf(stderr, "Unable to write %s\n", filename);
+        return 0;
+    }
+    printf("Wrote instruction statistics to %s\n", filename);
+    return 1;
+}
+
+static void write_stats_at_exit() {
+    write_stats(stats_file_name);
+}
+
+/* Turns on counting for -stats, writing the report when froot1 exits */
+void start_stats(char *filename) {
+    stats_file_name = filename;
+    statsenabled6502 = 1;
+    atexit(write_stats_at_exit);
+}
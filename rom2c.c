@@ -0,0 +1,90 @@
+/* Converts ROM files into C arrays so the default ROMs can be built into
+ * froot1. Each run of consecutive addresses becomes one segment. */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+int parse_rom_stream(FILE *in, char *name,
+        void (*row)(void *, uint32_t, const uint8_t *, int), void *context);
+
+unsigned char data[65536];
+bool loaded[65536];
+
+#define MAX_SEGMENTS 256
+char *segment_name[MAX_SEGMENTS];
+int segment_addr[MAX_SEGMENTS];
+int segment_len[MAX_SEGMENTS];
+
+void store_row(void *context, uint32_t addr, const uint8_t *bytes, int count) {
+    memcpy(&data[addr], bytes, count);
+    memset(&loaded[addr], true, count);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        printf("Please supply one or more ROM files\n");
+        exit(1);
+    }
+
+    int segments = 0;
+
+    printf("/* Generated from the ROM files by rom2c, do not edit */\n");
+    printf("#include <stdint.h>\n\n");
+    printf("struct builtin_rom {\n");
+    printf("    const char *name;\n");
+    printf("    uint16_t addr;\n");
+    printf("    uint32_t len;\n");
+    printf("    const uint8_t *data;\n");
+    printf("};\n\n");
+
+    for (int f=1; f < argc; f++) {
+        FILE *in;
+
+        if ((in = fopen(argv[f], "r")) == NULL) {
+            fprintf(stderr, "Can't open file %s\n", argv[f]);
+            exit(1);
+        }
+        memset(loaded, 0, sizeof(loaded));
+        if (!parse_rom_stream(in, argv[f], store_row, NULL)) {
+            exit(1);
+        }
+        fclose(in);
+
+        // The ROM name is the file name without any directory
+        char *name = strrchr(argv[f], '/');
+        name = (name != NULL) ? name + 1 : argv[f];
+
+        for (int addr=0; addr < 65536; ) {
+            if (!loaded[addr]) {
+                addr++;
+                continue;
+            }
+            int end = addr;
+            while ((end < 65536) && loaded[end]) end++;
+            if (segments == MAX_SEGMENTS) {
+                fprintf(stderr, "Too many segments\n");
+                exit(1);
+            }
+            printf("static const uint8_t segment%d[] = {", segments);
+            for (int i=addr; i < end; i++) {
+                printf("%s0x%02x,", ((i - addr) % 12) ? " " : "\n    ", data[i]);
+            }
+            printf("\n};\n\n");
+            segment_name[segments] = name;
+            segment_addr[segments] = addr;
+            segment_len[segments] = end - addr;
+            segments++;
+            addr = end;
+        }
+    }
+
+    printf("const struct builtin_rom builtin_roms[] = {\n");
+    for (int i=0; i < segments; i++) {
+        printf("    { \"%s\", 0x%04x, %d, segment%d },\n",
+            segment_name[i], segment_addr[i], segment_len[i], i);
+    }
+    printf("};\n\n");
+    printf("const int builtin_rom_count = %d;\n", segments);
+}
@@ -0,0 +1,78 @@
+/* Generated from the ROM files by rom2c, do not edit */
+#include <stdint.h>
+
+struct builtin_rom {
+    const char *name;
+    uint16_t addr;
+    uint32_t len;
+    const uint8_t *data;
+};
+
+static const uint8_t segment0[] = {
+    0xd8, 0x58, 0xa0, 0x7f, 0x8c, 0x12, 0xd0, 0xa9, 0xa7, 0x8d, 0x11, 0xd0,
+    0x8d, 0x13, 0xd0, 0xc9, 0x88, 0xf0, 0x13, 0xc9, 0x9b, 0xf0, 0x03, 0xc8,
+    0x10, 0x0f, 0xa9, 0xdc, 0x20, 0xef, 0xff, 0xa9, 0x8d, 0x20, 0xef, 0xff,
+    0xa0, 0x01, 0x88, 0x30, 0xf6, 0xad, 0x11, 0xd0, 0x10, 0xfb, 0xad, 0x10,
+    0xd0, 0x99, 0x00, 0x02, 0x20, 0xef, 0xff, 0xc9, 0x8d, 0xd0, 0xd4, 0xa0,
+    0xff, 0xa9, 0x00, 0xaa, 0x0a, 0x85, 0x2b, 0xc8, 0xb9, 0x00, 0x02, 0xc9,
+    0x8d, 0xf0, 0xd4, 0xc9, 0xae, 0x90, 0xf4, 0xf0, 0xf0, 0xc9, 0xba, 0xf0,
+    0xeb, 0xc9, 0xd2, 0xf0, 0x3b, 0x86, 0x28, 0x86, 0x29, 0x84, 0x2a, 0xb9,
+    0x00, 0x02, 0x49, 0xb0, 0xc9, 0x0a, 0x90, 0x06, 0x69, 0x88, 0xc9, 0xfa,
+    0x90, 0x11, 0x0a, 0x0a, 0x0a, 0x0a, 0xa2, 0x04, 0x0a, 0x26, 0x28, 0x26,
+    0x29, 0xca, 0xd0, 0xf8, 0xc8, 0xd0, 0xe0, 0xc4, 0x2a, 0xf0, 0x97, 0x24,
+    0x2b, 0x50, 0x10, 0xa5, 0x28, 0x81, 0x26, 0xe6, 0x26, 0xd0, 0xb5, 0xe6,
+    0x27, 0x4c, 0x44, 0xff, 0x6c, 0x24, 0x00, 0x30, 0x2b, 0xa2, 0x02, 0xb5,
+    0x27, 0x95, 0x25, 0x95, 0x23, 0xca, 0xd0, 0xf7, 0xd0, 0x14, 0xa9, 0x8d,
+    0x20, 0xef, 0xff, 0xa5, 0x25, 0x20, 0xdc, 0xff, 0xa5, 0x24, 0x20, 0xdc,
+    0xff, 0xa9, 0xba, 0x20, 0xef, 0xff, 0xa9, 0xa0, 0x20, 0xef, 0xff, 0xa1,
+    0x24, 0x20, 0xdc, 0xff, 0x86, 0x2b, 0xa5, 0x24, 0xc5, 0x28, 0xa5, 0x25,
+    0xe5, 0x29, 0xb0, 0xc1, 0xe6, 0x24, 0xd0, 0x02, 0xe6, 0x25, 0xa5, 0x24,
+    0x29, 0x07, 0x10, 0xc8, 0x48, 0x4a, 0x4a, 0x4a, 0x4a, 0x20, 0xe5, 0xff,
+    0x68, 0x29, 0x0f, 0x09, 0xb0, 0xc9, 0xba, 0x90, 0x02, 0x69, 0x06, 0x2c,
+    0x12, 0xd0, 0x30, 0xfb, 0x8d, 0x12, 0xd0, 0x60, 0x00, 0x00, 0x00, 0x0f,
+    0x00, 0xff, 0x00, 0x00,
+};
+
+static const uint8_t segment1[] = {
+    0xa9, 0xaa, 0x20, 0xef, 0xff, 0xa9, 0x8d, 0x20, 0xef, 0xff, 0xa0, 0xff,
+    0xc8, 0xad, 0x11, 0xd0, 0x10, 0xfb, 0xad, 0x10, 0xd0, 0x99, 0x00, 0x02,
+    0x20, 0xef, 0xff, 0xc9, 0x9b, 0xf0, 0xe1, 0xc9, 0x8d, 0xd0, 0xe9, 0xa2,
+    0xff, 0xa9, 0x00, 0x85, 0x24, 0x85, 0x25, 0x85, 0x26, 0x85, 0x27, 0xe8,
+    0xbd, 0x00, 0x02, 0xc9, 0xd2, 0xf0, 0x56, 0xc9, 0xd7, 0xf0, 0x35, 0xc9,
+    0xae, 0xf0, 0x27, 0xc9, 0x8d, 0xf0, 0x20, 0xc9, 0xa0, 0xf0, 0xe8, 0x49,
+    0xb0, 0xc9, 0x0a, 0x90, 0x06, 0x69, 0x88, 0xc9, 0xfa, 0x90, 0xad, 0x0a,
+    0x0a, 0x0a, 0x0a, 0xa0, 0x04, 0x0a, 0x26, 0x24, 0x26, 0x25, 0x88, 0xd0,
+    0xf8, 0xf0, 0xcc, 0x4c, 0x1a, 0xff, 0xa5, 0x24, 0x85, 0x26, 0xa5, 0x25,
+    0x85, 0x27, 0xb0, 0xbf, 0xa9, 0x40, 0x20, 0xcc, 0xc1, 0x88, 0xa2, 0x00,
+    0xa1, 0x26, 0xa2, 0x10, 0x0a, 0x20, 0xdb, 0xc1, 0xd0, 0xfa, 0x20, 0xf1,
+    0xc1, 0xa0, 0x1e, 0x90, 0xec, 0xa6, 0x28, 0xb0, 0x98, 0x20, 0xbc, 0xc1,
+    0xa9, 0x16, 0x20, 0xcc, 0xc1, 0x20, 0xbc, 0xc1, 0xa0, 0x1f, 0x20, 0xbf,
+    0xc1, 0xb0, 0xf9, 0x20, 0xbf, 0xc1, 0xa0, 0x3a, 0xa2, 0x08, 0x48, 0x20,
+    0xbc, 0xc1, 0x68, 0x2a, 0xa0, 0x39, 0xca, 0xd0, 0xf5, 0x81, 0x26, 0x20,
+    0xf1, 0xc1, 0xa0, 0x35, 0x90, 0xea, 0xb0, 0xcd, 0x20, 0xbf, 0xc1, 0x88,
+    0xad, 0x81, 0xc0, 0xc5, 0x29, 0xf0, 0xf8, 0x85, 0x29, 0xc0, 0x80, 0x60,
+    0x86, 0x28, 0xa0, 0x42, 0x20, 0xe0, 0xc1, 0xd0, 0xf9, 0x69, 0xfe, 0xb0,
+    0xf5, 0xa0, 0x1e, 0x20, 0xe0, 0xc1, 0xa0, 0x2c, 0x88, 0xd0, 0xfd, 0x90,
+    0x05, 0xa0, 0x2f, 0x88, 0xd0, 0xfd, 0xbc, 0x00, 0xc0, 0xa0, 0x29, 0xca,
+    0x60, 0xa5, 0x26, 0xc5, 0x24, 0xa5, 0x27, 0xe5, 0x25, 0xe6, 0x26, 0xd0,
+    0x02, 0xe6, 0x27, 0x60, 0x25, 0xe6, 0x26, 0xd0, 0x02, 0xe6, 0x27, 0x60,
+    0x25, 0xe6, 0x26, 0xd0, 0x02, 0xe6, 0x27, 0x60, 0x25, 0xe6, 0x26, 0xd0,
+    0x02, 0xe6, 0x27, 0x60, 0x25, 0xe6, 0x26, 0xd0, 0x02, 0xe6, 0x27, 0x60,
+    0x25, 0xe6, 0x26, 0xd0, 0x02, 0xe6, 0x27, 0x60, 0x25, 0xe6, 0x26, 0xd0,
+    0x02, 0xe6, 0x27, 0x60,
+};
+
+static const uint8_t segment2[] = {
+    0xa9, 0x00, 0x8d, 0x02, 0xc4, 0x8d, 0x03, 0xc4, 0x8d, 0x04, 0xc4, 0xa9,
+    0x03, 0x8d, 0x05, 0xc4, 0xa9, 0x01, 0x8d, 0x06, 0xc4, 0x20, 0x20, 0xc5,
+    0xb0, 0x03, 0x4c, 0x00, 0x03, 0x4c, 0x1a, 0xff, 0xa9, 0x01, 0xd0, 0x02,
+    0xa9, 0x02, 0x8d, 0x00, 0xc4, 0xad, 0x01, 0xc4, 0xc9, 0x01, 0x60, 0x00,
+};
+
+const struct builtin_rom builtin_roms[] = {
+    { "monitor.rom", 0xff00, 256, segment0 },
+    { "wozaci.rom", 0xc100, 304, segment1 },
+    { "disk.rom", 0xc500, 48, segment2 },
+};
+
+const int builtin_rom_count = 3;
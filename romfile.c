@@ -0,0 +1,290 @@
+/* Reading and writing ROM files, shared by froot1 and the tools.
+ *
+ * A ROM file is lines of a 4-digit hex address, a colon, and any number
+ * of 2-digit hex bytes, the same as the Woz monitor prints them:
+ *   aaaa: dd dd dd dd dd dd dd dd
+ * Lines don't have to be in order or next to each other, and a ; starts
+ * a comment that runs to the end of the line. Lines that start with a
+ * colon are Intel HEX records, so Intel HEX files can be read the same
+ * way. Raw binary files are read with a load address instead.
+ *
+ * Both directions work on large blocks and use lookup tables instead of
+ * converting a character at a time, so they are limited by I/O.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define BLOCK_SIZE 65536
+#define MAX_ROM_LINE 4096
+
+#define IHEX_DATA 0x00
+#define IHEX_EOF 0x01
+#define IHEX_SEGMENT 0x02
+#define IHEX_LINEAR 0x04
+#define IHEX_ROW_WIDTH 16
+
+static int8_t hex_digit[256];
+static char hex_pair[256][2];
+static bool tables_ready = false;
+
+static void init_tables() {
+    const char *digits = "0123456789ABCDEF";
+
+    memset(hex_digit, -1, sizeof(hex_digit));
+    for (int i=0; i < 16; i++) {
+        hex_digit[(uint8_t) digits[i]] = i;
+        hex_digit[(uint8_t) "0123456789abcdef"[i]] = i;
+    }
+    for (int i=0; i < 256; i++) {
+        hex_pair[i][0] = digits[i >> 4];
+        hex_pair[i][1] = digits[i & 15];
+    }
+    tables_ready = true;
+}
+
+int hex_digit_value(char ch) {
+    if (!tables_ready) init_tables();
+    return hex_digit[(uint8_t) ch];
+}
+
+// Intel HEX state for the file being read
+static uint32_t ihex_base;
+static bool ihex_done;
+
+/* Parses an Intel HEX record, p is just past the colon */
+static bool parse_ihex_line(const uint8_t *p, const uint8_t *end, char *name, int line_number,
+        void (*row)(void *, uint32_t, const uint8_t *, int), void *context) {
+    static uint8_t bytes[MAX_ROM_LINE / 2];
+    int count = 0;
+    uint8_t sum = 0;
+
+    while ((end > p) && ((end[-1] == '\r') || (end[-1] == ' ') || (end[-1] == '\t'))) end--;
+    while (p + 1 < end) {
+        if ((hex_digit[p[0]] < 0) || (hex_digit[p[1]] < 0)) break;
+        bytes[count] = (hex_digit[p[0]] << 4) | hex_digit[p[1]];
+        sum += bytes[count++];
+        p += 2;
+    }
+    if ((p != end) || (count < 5) || (bytes[0] != count - 5)) {
+        fprintf(stderr, "Bad Intel HEX record in %s at line %d\n", name, line_number);
+        return false;
+    }
+    if (sum != 0) {
+        fprintf(stderr, "Bad Intel HEX checksum in %s at line %d\n", name, line_number);
+        return false;
+    }
+
+    uint32_t addr = ihex_base + ((bytes[1] << 8) | bytes[2]);
+    int len = bytes[0];
+    switch (bytes[3]) {
+        case IHEX_DATA:
+            if (addr + len > 65536) {
+                fprintf(stderr, "Record at %x is past FFFF in %s at line %d\n", addr, name, line_number);
+                return false;
+            }
+            if (len > 0) {
+                row(context, addr, bytes + 4, len);
+            }
+            break;
+        case IHEX_EOF:
+            ihex_done = true;
+            break;
+        case IHEX_SEGMENT:
+            ihex_base = ((bytes[4] << 8) | bytes[5]) << 4;
+            break;
+        case IHEX_LINEAR:
+            ihex_base = ((bytes[4] << 8) | bytes[5]) << 16;
+            break;
+        default:
+            // Start addresses don't mean anything here
+            break;
+    }
+    return true;
+}
+
+/* Parses one line, calling row with its bytes. Returns false and prints
+ * an error if the line isn't valid. */
+static bool parse_rom_line(char *line, int len, char *name, int line_number,
+        void (*row)(void *, uint32_t, const uint8_t *, int), void *context) {
+    static uint8_t bytes[MAX_ROM_LINE / 2];
+    const uint8_t *p = (const uint8_t *) line;
+    const uint8_t *end = p + len;
+    int count = 0;
+
+    while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r'))) p++;
+    if ((p == end) || (*p == ';') || ihex_done) {
+        return true;
+    }
+    if (*p == ':') {
+        return parse_ihex_line(p + 1, end, name, line_number, row, context);
+    }
+
+    uint32_t addr = 0;
+    for (int i=0; i < 4; i++) {
+        if ((p == end) || (hex_digit[*p] < 0)) {
+            fprintf(stderr, "Expected a 4-digit address in %s at line %d\n", name, line_number);
+            return false;
+        }
+        addr = (addr << 4) | hex_digit[*p++];
+    }
+    if ((p == end) || (*p++ != ':')) {
+        fprintf(stderr, "No : after 4-digit address in %s at line %d\n", name, line_number);
+        return false;
+    }
+
+    for (;;) {
+        while ((p < end) && ((*p == ' ') || (*p == '\t') || (*p == '\r'))) p++;
+        if ((p == end) || (*p == ';')) {
+            break;
+        }
+        if ((p + 1 >= end) || (hex_digit[p[0]] < 0) || (hex_digit[p[1]] < 0)) {
+            fprintf(stderr, "Bad byte in %s at line %d\n", name, line_number);
+            return false;
+        }
+        bytes[count++] = (hex_digit[p[0]] << 4) | hex_digit[p[1]];
+        p += 2;
+    }
+    if (addr + count > 65536) {
+        fprintf(stderr, "Row at %04x goes past FFFF in %s at line %d\n", addr, name, line_number);
+        return false;
+    }
+    if (count > 0) {
+        row(context, addr, bytes, count);
+    }
+    return true;
+}
+
+/* Reads a whole ROM file, calling row for each line that has bytes.
+ * Returns 1 if the file was read, 0 on an error. */
+int parse_rom_stream(FILE *in, char *name,
+        void (*row)(void *, uint32_t, const uint8_t *, int), void *context) {
+    static char buffer[BLOCK_SIZE + MAX_ROM_LINE];
+    int kept = 0;
+    int line_number = 0;
+
+    if (!tables_ready) init_tables();
+    ihex_base = 0;
+    ihex_done = false;
+
+    for (;;) {
+        int got = fread(buffer + kept, 1, BLOCK_SIZE, in);
+        int len = kept + got;
+        int start = 0;
+        char *newline;
+
+        while ((newline = memchr(buffer + start, '\n', len - start)) != NULL) {
+            int line_end = newline - buffer;
+            if (!parse_rom_line(buffer + start, line_end - start, name, ++line_number, row, context)) {
+                return 0;
+            }
+            start = line_end + 1;
+        }
+        kept = len - start;
+        if (got == 0) {
+            // The last line may not have a newline
+            return (kept == 0) ||
+                parse_rom_line(buffer + start, kept, name, ++line_number, row, context);
+        }
+        if (kept >= MAX_ROM_LINE) {
+            fprintf(stderr, "Line %d in %s is too long\n", line_number + 1, name);
+            return 0;
+        }
+        memmove(buffer, buffer + start, kept);
+    }
+}
+
+/* Writes data as ROM rows of width bytes, starting at addr. Each row is
+ * built with a table lookup per byte and the output goes out in blocks. */
+void write_rom_rows(FILE *out, uint32_t addr, const uint8_t *data, size_t len, int width) {
+    static char buffer[BLOCK_SIZE + MAX_ROM_LINE];
+    int used = 0;
+
+    if (!tables_ready) init_tables();
+
+    for (size_t pos=0; pos < len; pos += width) {
+        int count = (len - pos < width) ? len - pos : width;
+        char *p = buffer + used;
+
+        *p++ = hex_pair[(addr >> 8) & 0xff][0];
+        *p++ = hex_pair[(addr >> 8) & 0xff][1];
+        *p++ = hex_pair[addr & 0xff][0];
+        *p++ = hex_pair[addr & 0xff][1];
+        *p++ = ':';
+        for (int i=0; i < count; i++) {
+            *p++ = ' ';
+            memcpy(p, hex_pair[data[pos+i]], 2);
+            p += 2;
+        }
+        *p++ = '\n';
+        used = p - buffer;
+        addr += count;
+
+        if (used >= BLOCK_SIZE) {
+            fwrite(buffer, 1, used, out);
+            used = 0;
+        }
+    }
+    fwrite(buffer, 1, used, out);
+}
+
+/* Reads a raw binary file to be loaded at addr, calling row for each
+ * block. Returns 0 if it doesn't fit below 10000. */
+int parse_binary_stream(FILE *in, char *name, uint32_t addr,
+        void (*row)(void *, uint32_t, const uint8_t *, int), void *context) {
+    static uint8_t buffer[BLOCK_SIZE];
+    int got;
+
+    while ((got = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (addr + got > 65536) {
+            fprintf(stderr, "%s goes past FFFF when loaded\n", name);
+            return 0;
+        }
+        row(context, addr, buffer, got);
+        addr += got;
+    }
+    return 1;
+}
+
+/* Appends one Intel HEX record to the buffer, returns the new end */
+static char *ihex_record(char *p, uint32_t addr, int type, const uint8_t *data, int count) {
+    uint8_t sum = count + (addr >> 8) + addr + type;
+
+    *p++ = ':';
+    memcpy(p, hex_pair[count], 2);
+    memcpy(p+2, hex_pair[(addr >> 8) & 0xff], 2);
+    memcpy(p+4, hex_pair[addr & 0xff], 2);
+    memcpy(p+6, hex_pair[type], 2);
+    p += 8;
+    for (int i=0; i < count; i++) {
+        sum += data[i];
+        memcpy(p, hex_pair[data[i]], 2);
+        p += 2;
+    }
+    memcpy(p, hex_pair[(uint8_t) -sum], 2);
+    p += 2;
+    *p++ = '\n';
+    return p;
+}
+
+/* Writes data as Intel HEX records starting at addr, with an end record */
+void write_ihex_rows(FILE *out, uint32_t addr, const uint8_t *data, size_t len) {
+    static char buffer[BLOCK_SIZE + MAX_ROM_LINE];
+    char *p = buffer;
+
+    if (!tables_ready) init_tables();
+
+    for (size_t pos=0; pos < len; pos += IHEX_ROW_WIDTH) {
+        int count = (len - pos < IHEX_ROW_WIDTH) ? len - pos : IHEX_ROW_WIDTH;
+        p = ihex_record(p, addr, IHEX_DATA, data + pos, count);
+        addr += count;
+        if (p - buffer >= BLOCK_SIZE) {
+            fwrite(buffer, 1, p - buffer, out);
+            p = buffer;
+        }
+    }
+    p = ihex_record(p, 0, IHEX_EOF, NULL, 0);
+    fwrite(buffer, 1, p - buffer, out);
+}
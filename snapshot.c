@@ -0,0 +1,204 @@
+/* Named snapshots of memory and registers for the debugger, and diffs
+ * between them (or between a snapshot and the machine as it is now).
+ *
+ * Memory is compared 8 bytes at a time, only dropping to single bytes
+ * inside a word that differs, so a diff of all 64K is a few thousand
+ * compares when little has changed. Changed bytes close together are
+ * reported as one range.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+extern uint8_t ram[65536];
+extern volatile uint16_t pc;
+extern volatile uint8_t a, x, y, sp, status;
+extern volatile uint32_t clockticks6502;
+
+char *addr_name(uint16_t);
+
+#define MAX_SNAPSHOTS 16
+#define MAX_SNAPSHOT_NAME 32
+#define RANGE_GAP 8         // changes closer than this are one range
+#define MAX_DIFF_RANGES 64
+#define SHOW_BYTES_MAX 8    // ranges this short show the old and new bytes
+
+struct snapshot {
+    char name[MAX_SNAPSHOT_NAME];
+    uint8_t mem[65536];
+    uint16_t pc;
+    uint8_t a, x, y, sp, status;
+    uint32_t clockticks;
+};
+
+static struct snapshot *snapshots[MAX_SNAPSHOTS];
+
+static struct snapshot *find_snapshot(char *name) {
+    for (int i=0; i < MAX_SNAPSHOTS; i++) {
+        if ((snapshots[i] != NULL) && !strcmp(snapshots[i]->name, name)) {
+            return snapshots[i];
+        }
+    }
+    return NULL;
+}
+
+static void capture(struct snapshot *snap) {
+    memcpy(snap->mem, ram, sizeof(snap->mem));
+    snap->pc = pc;
+    snap->a = a;
+    snap->x = x;
+    snap->y = y;
+    snap->sp = sp;
+    snap->status = status;
+    snap->clockticks = clockticks6502;
+}
+
+/* Saves the current state as name, replacing a snapshot with that name */
+int take_snapshot(char *name) {
+    if (strlen(name) >= MAX_SNAPSHOT_NAME) {
+        printf("Snapshot names can be at most %d characters\n", MAX_SNAPSHOT_NAME-1);
+        return 0;
+    }
+    if (!strcmp(name, "now")) {
+        printf("now is the current state and can't be a snapshot name\n");
+        return 0;
+    }
+    struct snapshot *snap = find_snapshot(name);
+    for (int i=0; (snap == NULL) && (i < MAX_SNAPSHOTS); i++) {
+        if (snapshots[i] == NULL) {
+            snap = snapshots[i] = malloc(sizeof(struct snapshot));
+            strcpy(snap->name, name);
+        }
+    }
+    if (snap == NULL) {
+        printf("All %d snapshots are in use, delete one with snap -name\n", MAX_SNAPSHOTS);
+        return 0;
+    }
+    capture(snap);
+    printf("Saved snapshot %s at pc %04x\n", name, pc);
+    return 1;
+}
+
+int delete_snapshot(char *name) {
+    for (int i=0; i < MAX_SNAPSHOTS; i++) {
+        if ((snapshots[i] != NULL) && !strcmp(snapshots[i]->name, name)) {
+            free(snapshots[i]);
+            snapshots[i] = NULL;
+            printf("Deleted snapshot %s\n", name);
+            return 1;
+        }
+    }
+    printf("No snapshot named %s\n", name);
+    return 0;
+}
+
+void list_snapshots() {
+    bool any = false;
+    for (int i=0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshots[i] != NULL) {
+            printf("%-16s pc=%04x  cycles=%u\n", snapshots[i]->name, snapshots[i]->pc,
+                snapshots[i]->clockticks);
+            any = true;
+        }
+    }
+    if (!any) {
+        printf("No snapshots.\n");
+    }
+}
+
+/* Returns the first address at or after addr where old and new differ,
+ * or 65536 if there isn't one */
+static uint32_t next_difference(const uint8_t *old, const uint8_t *new, uint32_t addr) {
+    // Get to a word boundary a byte at a time
+    while ((addr < 65536) && (addr & 7)) {
+        if (old[addr] != new[addr]) return addr;
+        addr++;
+    }
+    while (addr < 65536) {
+        uint64_t old_word, new_word;
+        memcpy(&old_word, old + addr, 8);
+        memcpy(&new_word, new + addr, 8);
+        if (old_word != new_word) {
+            while (old[addr] == new[addr]) addr++;
+            return addr;
+        }
+        addr += 8;
+    }
+    return 65536;
+}
+
+static void diff_reg(char *name, int old, int new, int digits) {
+    if (old != new) {
+        printf("  %s %0*x -> %0*x\n", name, digits, old, digits, new);
+    }
+}
+
+/* Shows what changed from snapshot old_name to new_name, where now
+ * (or no name) is the current state */
+int diff_snapshots(char *old_name, char *new_name) {
+    static struct snapshot current;
+    struct snapshot *old = find_snapshot(old_name);
+    struct snapshot *new = &current;
+
+    if (old == NULL) {
+        printf("No snapshot named %s\n", old_name);
+        return 0;
+    }
+    if ((new_name != NULL) && strcmp(new_name, "now")) {
+        if ((new = find_snapshot(new_name)) == NULL) {
+            printf("No snapshot named %s\n", new_name);
+            return 0;
+        }
+    } else {
+        capture(&current);
+        strcpy(current.name, "now");
+    }
+
+    printf("%s -> %s, %u cycles\n", old->name, new->name, new->clockticks - old->clockticks);
+    diff_reg("pc", old->pc, new->pc, 4);
+    diff_reg("a ", old->a, new->a, 2);
+    diff_reg("x ", old->x, new->x, 2);
+    diff_reg("y ", old->y, new->y, 2);
+    diff_reg("sp", old->sp, new->sp, 2);
+    diff_reg("status", old->status, new->status, 2);
+
+    int ranges = 0;
+    int changed = 0;
+    uint32_t addr = next_difference(old->mem, new->mem, 0);
+    while (addr < 65536) {
+        // Extend the range while the next change is close by
+        uint32_t start = addr;
+        uint32_t end = addr;
+        int count = 0;
+        while (addr < 65536) {
+            end = addr;
+            count++;
+            addr = next_difference(old->mem, new->mem, addr + 1);
+            if (addr - end > RANGE_GAP) break;
+        }
+        changed += count;
+
+        if (ranges++ < MAX_DIFF_RANGES) {
+            printf("  %s", addr_name(start));
+            if (end > start) {
+                printf(" - %04x", end);
+            }
+            if (end - start < SHOW_BYTES_MAX) {
+                printf(":");
+                for (uint32_t i=start; i <= end; i++) printf(" %02x", old->mem[i]);
+                printf(" ->");
+                for (uint32_t i=start; i <= end; i++) printf(" %02x", new->mem[i]);
+                printf("\n");
+            } else {
+                printf(": %d bytes changed\n", count);
+            }
+        }
+    }
+    if (ranges > MAX_DIFF_RANGES) {
+        printf("  ... and %d more ranges\n", ranges - MAX_DIFF_RANGES);
+    }
+    printf("%d bytes changed in %d ranges\n", changed, ranges);
+    return 1;
+}
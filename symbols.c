@@ -0,0 +1,234 @@
+/* Symbol table for the debugger, loaded from ca65/ld65 debug files.
+ *
+ * Names are kept in large arena blocks instead of a malloc each, and
+ * looked up through an open-addressed hash table. For going from an
+ * address back to a symbol, an index of the symbols sorted by value is
+ * built the first time it is needed after a load, and searched with a
+ * binary search for the closest symbol at or below the address.
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 65536
+#define INITIAL_TABLE_SIZE 1024     // must be a power of 2
+
+struct symbol {
+    const char *name;
+    uint16_t value;
+    uint32_t hash;
+};
+
+static struct symbol *symbols = NULL;
+static int symbol_count = 0;
+static int symbol_capacity = 0;
+
+// Hash table of indexes into symbols, -1 for an empty slot
+static int32_t *table = NULL;
+static uint32_t table_size = 0;
+
+// Indexes into symbols sorted by value, rebuilt after loading more
+static int32_t *by_value = NULL;
+static bool by_value_ready = false;
+
+static char *arena = NULL;
+static int arena_used = ARENA_BLOCK_SIZE;
+
+static char *arena_copy(const char *name, int len) {
+    if (arena_used + len + 1 > ARENA_BLOCK_SIZE) {
+        arena = malloc(len + 1 > ARENA_BLOCK_SIZE ? len + 1 : ARENA_BLOCK_SIZE);
+        arena_used = 0;
+    }
+    char *copy = arena + arena_used;
+    memcpy(copy, name, len);
+    copy[len] = 0;
+    arena_used += len + 1;
+    return copy;
+}
+
+static uint32_t hash_name(const char *name) {
+    uint32_t hash = 2166136261u;
+    while (*name) {
+        hash = (hash ^ (uint8_t) *name++) * 16777619u;
+    }
+    return hash;
+}
+
+static int32_t *find_slot(const char *name, uint32_t hash) {
+    uint32_t mask = table_size - 1;
+    uint32_t pos = hash & mask;
+
+    while (table[pos] >= 0) {
+        struct symbol *sym = &symbols[table[pos]];
+        if ((sym->hash == hash) && !strcmp(sym->name, name)) {
+            break;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return &table[pos];
+}
+
+static void grow_table() {
+    int32_t *old_table = table;
+    uint32_t old_size = table_size;
+
+    table_size = (table_size == 0) ? INITIAL_TABLE_SIZE : table_size * 2;
+    table = malloc(table_size * sizeof(int32_t));
+    memset(table, -1, table_size * sizeof(int32_t));
+    for (uint32_t i=0; i < old_size; i++) {
+        if (old_table[i] >= 0) {
+            struct symbol *sym = &symbols[old_table[i]];
+            *find_slot(sym->name, sym->hash) = old_table[i];
+        }
+    }
+    free(old_table);
+}
+
+/* Adds a symbol, the first definition of a name wins */
+static void add_symbol(const char *name, int len, uint16_t value) {
+    char key[256];
+
+    if (len >= sizeof(key)) len = sizeof(key) - 1;
+    memcpy(key, name, len);
+    key[len] = 0;
+
+    if ((symbol_count + 1) * 2 > table_size) {
+        grow_table();
+    }
+    uint32_t hash = hash_name(key);
+    int32_t *slot = find_slot(key, hash);
+    if (*slot >= 0) {
+        return;
+    }
+
+    if (symbol_count == symbol_capacity) {
+        symbol_capacity = (symbol_capacity == 0) ? 1024 : symbol_capacity * 2;
+        symbols = realloc(symbols, symbol_capacity * sizeof(struct symbol));
+    }
+    symbols[symbol_count].name = arena_copy(key, len);
+    symbols[symbol_count].value = value;
+    symbols[symbol_count].hash = hash;
+    *slot = symbol_count++;
+    by_value_ready = false;
+}
+
+int load_syms(char *filename) {
+    FILE *in;
+    char line[1024];
+
+    printf("Loading symbols from %s\n", filename);
+    // Open the input file
+    if ((in = fopen(filename, "r")) == NULL) {
+        snprintf(line, sizeof(line)-1, "/usr/local/share/froot-1/%s", filename);
+        if ((in = fopen(line, "r")) == NULL) {
+            fprintf(stderr, "Can't open file %s\n", filename);
+            return 0;
+        }
+    }
+
+    // Read it line-by line, only sym lines matter
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, "sym", 3)) continue;
+
+        char *name_start = strstr(line, "name=\"");
+        if (!name_start) continue;
+        char *val_start = strstr(line, "val=0x");
+        if (!val_start) continue;
+
+        char *name = name_start + 6;
+        char *quote_pos = strchr(name, '"');
+        if (quote_pos == NULL) continue;
+
+        char *end;
+        long val = strtol(val_start + 6, &end, 16);
+        if ((end == val_start + 6) || (*end != ',')) continue;
+
+        add_symbol(name, quote_pos - name, val);
+    }
+    fclose(in);
+    return 1;
+}
+
+int find_symbol(char *symbol, uint16_t *value) {
+    if (symbol_count == 0) {
+        return 0;
+    }
+    int32_t index = *find_slot(symbol, hash_name(symbol));
+    if (index < 0) {
+        return 0;
+    }
+    *value = symbols[index].value;
+    return 1;
+}
+
+static int compare_by_value(const void *a, const void *b) {
+    const struct symbol *sym_a = &symbols[*(const int32_t *) a];
+    const struct symbol *sym_b = &symbols[*(const int32_t *) b];
+
+    if (sym_a->value != sym_b->value) {
+        return sym_a->value - sym_b->value;
+    }
+    // Keep symbols at the same address in the order they were loaded
+    return *(const int32_t *) a - *(const int32_t *) b;
+}
+
+/* Finds the closest symbol at or below addr that is no more than
+ * max_offset below it. Returns its name and sets offset, or returns
+ * NULL if there isn't one. */
+const char *symbol_at(uint16_t addr, uint16_t max_offset, uint16_t *offset) {
+    if (symbol_count == 0) {
+        return NULL;
+    }
+    if (!by_value_ready) {
+        by_value = realloc(by_value, symbol_count * sizeof(int32_t));
+        for (int i=0; i < symbol_count; i++) {
+            by_value[i] = i;
+        }
+        qsort(by_value, symbol_count, sizeof(int32_t), compare_by_value);
+        by_value_ready = true;
+    }
+
+    // Find the first symbol above addr, the one before it is the closest
+    int low = 0;
+    int high = symbol_count;
+    while (low < high) {
+        int mid = (low + high) / 2;
+        if (symbols[by_value[mid]].value <= addr) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+    // Use the first of several symbols at the same address
+    uint16_t value = symbols[by_value[low-1]].value;
+    while ((low > 1) && (symbols[by_value[low-2]].value == value)) {
+        low--;
+    }
+    if (addr - value > max_offset) {
+        return NULL;
+    }
+    *offset = addr - value;
+    return symbols[by_value[low-1]].name;
+}
+
+/* Formats addr as name or name+offset if there is a symbol close enough,
+ * otherwise returns false and leaves text alone */
+bool format_symbol(uint16_t addr, uint16_t max_offset, char *text, int size) {
+    uint16_t offset;
+    const char *name = symbol_at(addr, max_offset, &offset);
+
+    if (name == NULL) {
+        return false;
+    }
+    if (offset == 0) {
+        snprintf(text, size, "%s", name);
+    } else {
+        snprintf(text, size, "%s+%x", name, offset);
+    }
+    return true;
+}
@@ -0,0 +1,44 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+bool wav_read_start(FILE *in);
+int wav_read_record(FILE *in, uint8_t *data, int max_len);
+
+uint8_t data[65536];
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        printf("Please supply an input WAV file and an output file\n");
+        printf("All the cassette records in the WAV file are written to the output file\n");
+        exit(1);
+    }
+
+    FILE *in;
+    FILE *out;
+
+    if ((in = fopen(argv[1], "rb")) == NULL) {
+        fprintf(stderr, "Unable to open file %s\n", argv[1]);
+        exit(1);
+    }
+
+    if (!wav_read_start(in)) {
+        exit(1);
+    }
+
+    if ((out = fopen(argv[2], "wb")) == NULL) {
+        fprintf(stderr, "Unable to open file %s\n", argv[2]);
+        exit(1);
+    }
+
+    int len;
+    int records = 0;
+    while ((len = wav_read_record(in, data, sizeof(data))) >= 0) {
+        records++;
+        printf("Record %d: %d bytes\n", records, len);
+        fwrite(data, 1, len, out);
+    }
+    fclose(in);
+    fclose(out);
+}
@@ -0,0 +1,760 @@
+/* Native support for Woz (Apple-1) BASIC programs.
+ *
+ * load_basic() tokenizes a BASIC source file on the host and stores it
+ * in memory the same way the BASIC line editor would, so a program is
+ * ready to RUN as soon as BASIC is started with E2B3R (the warm start
+ * that keeps the current program).
+ *
+ * A program is stored as a list of lines running from PP up to HIMEM,
+ * in line number order. Each line is:
+ *   length (including this byte), line number (low, high), tokens, $01
+ * Most tokens depend on where they appear, for example a comma in a
+ * PRINT statement is $48 or $49 depending on whether a string or a
+ * number follows it, so the tokenizer follows the BASIC grammar
+ * instead of doing a simple keyword lookup.
+ *   Variables - name with the high bit set, string variables add $40 ($)
+ *   Numbers   - first digit with the high bit set, then the 16-bit value
+ *   Strings   - $28, characters with the high bit set, $29
+ *   REM       - $5D followed by the rest of the line with the high bit set
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+
+extern uint8_t ram[65536];
+extern bool rom[65536];
+
+// Woz BASIC zero page pointers
+#define BASIC_LOMEM 0x4a   // start of variables
+#define BASIC_HIMEM 0x4c   // end of program
+#define BASIC_PP    0xca   // start of program, grows down from HIMEM
+#define BASIC_PV    0xcc   // end of variables, grows up from LOMEM
+
+// Where BASIC's cold start (E000R) puts LOMEM and HIMEM
+#define DEFAULT_LOMEM 0x0800
+#define DEFAULT_HIMEM 0x1000
+
+#define MAX_LINE_LEN 255
+#define MAX_LINE_NUMBER 32767
+
+#define TOK_EOL 0x01
+#define TOK_COLON 0x03
+
+struct basic_line {
+    uint16_t number;
+    int order;          // position in the file, a later line replaces an earlier one
+    uint8_t len;
+    uint8_t bytes[MAX_LINE_LEN];
+};
+
+// Tokenizer state for the current line
+static char *src;
+static uint8_t tok[MAX_LINE_LEN];
+static int tok_len;
+static const char *tok_error;
+
+static bool statement();
+static bool expression();
+
+static bool fail(const char *message) {
+    if (tok_error == NULL) {
+        tok_error = message;
+    }
+    return false;
+}
+
+/* Returns the next non-blank character, Woz BASIC ignores spaces
+ * everywhere except in strings and REM statements */
+static char peek() {
+    while (*src == ' ') src++;
+    return *src;
+}
+
+/* Consumes word if it is next in the line, allowing spaces inside it */
+static bool match(const char *word) {
+    char *p = src;
+    while (*word) {
+        while (*p == ' ') p++;
+        if (*p != *word) return false;
+        p++;
+        word++;
+    }
+    src = p;
+    return true;
+}
+
+static bool emit(uint8_t value) {
+    // Leave room for the header and the end of line token
+    if (tok_len >= MAX_LINE_LEN - 4) {
+        return fail("line too long");
+    }
+    tok[tok_len++] = value;
+    return true;
+}
+
+static bool at_end() {
+    char ch = peek();
+    return (ch == 0) || (ch == ':');
+}
+
+/* A variable is a letter optionally followed by a digit */
+static bool variable_name() {
+    if (!isupper(peek())) {
+        return fail("expected a variable");
+    }
+    if (!emit(0x80 | *src++)) return false;
+    if (isdigit(peek())) {
+        if (!emit(0x80 | *src++)) return false;
+    }
+    return true;
+}
+
+static bool at_string_var() {
+    char *save = src;
+    bool result = false;
+
+    if (isupper(peek())) {
+        src++;
+        if (isdigit(peek())) src++;
+        result = (peek() == '$');
+    }
+    src = save;
+    return result;
+}
+
+static bool at_string() {
+    return (peek() == '"') || at_string_var();
+}
+
+static bool number() {
+    char first = peek();
+    long value = 0;
+
+    if (!isdigit(first)) {
+        return fail("expected a number");
+    }
+    while (isdigit(peek())) {
+        value = value * 10 + (*src++ - '0');
+        if (value > 32767) {
+            return fail(">32767");
+        }
+    }
+    return emit(0x80 | first) && emit(value & 0xff) && emit(value >> 8);
+}
+
+static bool close_paren() {
+    if (!match(")")) {
+        return fail("expected )");
+    }
+    return emit(0x72);
+}
+
+static bool string_literal() {
+    peek();
+    src++;      // opening quote
+    if (!emit(0x28)) return false;
+    while (*src != '"') {
+        if (*src == 0) {
+            return fail("no closing quote");
+        }
+        if (!emit(0x80 | *src++)) return false;
+    }
+    src++;
+    return emit(0x29);
+}
+
+/* A string literal, or a string variable with an optional substring */
+static bool string_expression() {
+    if (peek() == '"') {
+        return string_literal();
+    }
+    if (!at_string_var()) {
+        return fail("expected a string");
+    }
+    if (!variable_name()) return false;
+    match("$");
+    if (!emit(0x40)) return false;
+    if (match("(")) {
+        if (!emit(0x2a) || !expression()) return false;
+        if (match(",")) {
+            if (!emit(0x23) || !expression()) return false;
+        }
+        return close_paren();
+    }
+    return true;
+}
+
+static bool primary() {
+    char ch = peek();
+
+    if (ch == '(') {
+        src++;
+        return emit(0x38) && expression() && close_paren();
+    } else if (isdigit(ch)) {
+        return number();
+    } else if (ch == '"' || at_string_var()) {
+        // A string comparison is a number
+        if (!string_expression()) return false;
+        if (match("=")) {
+            if (!emit(0x39)) return false;
+        } else if (match("#")) {
+            if (!emit(0x3a)) return false;
+        } else {
+            return fail("expected = or # after a string");
+        }
+        return string_expression();
+    } else if (match("LEN(")) {
+        return emit(0x3b) && string_expression() && close_paren();
+    }
+
+    static const struct { const char *name; uint8_t token; } functions[] = {
+        { "PEEK", 0x2e }, { "RND", 0x2f }, { "SGN", 0x30 }, { "ABS", 0x31 }
+    };
+    for (int i=0; i < sizeof(functions) / sizeof(functions[0]); i++) {
+        char *save = src;
+        if (match(functions[i].name)) {
+            if (!match("(")) {
+                src = save;
+                break;
+            }
+            return emit(functions[i].token) && emit(0x3f) && expression() && close_paren();
+        }
+    }
+
+    if (!isupper(ch)) {
+        return fail("syntax error");
+    }
+    if (!variable_name()) return false;
+    if (match("(")) {
+        return emit(0x2d) && expression() && close_paren();
+    }
+    return true;
+}
+
+static bool expression() {
+    static const struct { const char *op; uint8_t token; } binary_ops[] = {
+        { ">=", 0x18 }, { "<=", 0x1a }, { "<>", 0x1b }, { ">", 0x19 },
+        { "<", 0x1c }, { "=", 0x16 }, { "#", 0x17 }, { "+", 0x12 },
+        { "-", 0x13 }, { "*", 0x14 }, { "/", 0x15 }, { "^", 0x20 },
+        { "AND", 0x1d }, { "OR", 0x1e }, { "MOD", 0x1f }
+    };
+
+    for (;;) {
+        // Only one unary operator is allowed in front of a value
+        if (match("-")) {
+            if (!emit(0x36)) return false;
+        } else if (match("+")) {
+            if (!emit(0x35)) return false;
+        } else if (match("NOT")) {
+            if (!emit(0x37)) return false;
+        }
+        if (!primary()) return false;
+
+        int i;
+        for (i=0; i < sizeof(binary_ops) / sizeof(binary_ops[0]); i++) {
+            if (match(binary_ops[i].op)) {
+                if (!emit(binary_ops[i].token)) return false;
+                break;
+            }
+        }
+        if (i == sizeof(binary_ops) / sizeof(binary_ops[0])) {
+            return true;
+        }
+    }
+}
+
+static bool assignment() {
+    if (at_string_var()) {
+        if (!variable_name()) return false;
+        match("$");
+        if (!emit(0x40)) return false;
+        if (match("(")) {
+            if (!emit(0x42) || !expression() || !close_paren()) return false;
+        }
+        if (!match("=")) {
+            return fail("expected =");
+        }
+        return emit(0x70) && string_expression();
+    }
+
+    if (!variable_name()) return false;
+    if (match("(")) {
+        if (!emit(0x2d) || !expression() || !close_paren()) return false;
+    }
+    if (!match("=")) {
+        return fail("expected =");
+    }
+    return emit(0x71) && expression();
+}
+
+static bool print_statement() {
+    if (at_end()) {
+        return emit(0x63);
+    }
+    if (!emit(at_string() ? 0x61 : 0x62)) return false;
+
+    for (;;) {
+        if (at_string()) {
+            if (!string_expression()) return false;
+        } else {
+            if (!expression()) return false;
+        }
+
+        if (match(";")) {
+            if (at_end()) {
+                return emit(0x47);
+            }
+            if (!emit(at_string() ? 0x45 : 0x46)) return false;
+        } else if (match(",")) {
+            // There is no token for a comma at the end, the line editor
+            // rejects it too
+            if (at_end()) {
+                return fail("PRINT can't end with a comma");
+            }
+            if (!emit(at_string() ? 0x48 : 0x49)) return false;
+        } else {
+            return true;
+        }
+    }
+}
+
+static bool input_variable() {
+    if (at_string_var()) {
+        if (!variable_name()) return false;
+        match("$");
+        if (!emit(0x40)) return false;
+        if (match("(")) {
+            return emit(0x42) && expression() && close_paren();
+        }
+        return true;
+    }
+    if (!variable_name()) return false;
+    if (match("(")) {
+        return emit(0x2d) && expression() && close_paren();
+    }
+    return true;
+}
+
+static bool input_statement() {
+    if (peek() == '"') {
+        if (!emit(0x53) || !string_literal()) return false;
+        if (!match(",")) return true;
+    } else {
+        if (!emit(at_string_var() ? 0x52 : 0x54)) return false;
+        if (!input_variable()) return false;
+        if (!match(",")) return true;
+    }
+    for (;;) {
+        if (!emit(at_string_var() ? 0x26 : 0x27) || !input_variable()) return false;
+        if (!match(",")) return true;
+    }
+}
+
+static bool dim_statement() {
+    if (!emit(at_string_var() ? 0x4e : 0x4f)) return false;
+    for (;;) {
+        if (at_string_var()) {
+            if (!variable_name()) return false;
+            match("$");
+            if (!emit(0x40)) return false;
+            if (!match("(")) {
+                return fail("expected (");
+            }
+            if (!emit(0x22)) return false;
+        } else {
+            if (!variable_name()) return false;
+            if (!match("(")) {
+                return fail("expected (");
+            }
+            if (!emit(0x34)) return false;
+        }
+        if (!expression() || !close_paren()) return false;
+        if (!match(",")) return true;
+        if (!emit(at_string_var() ? 0x43 : 0x44)) return false;
+    }
+}
+
+static bool statement() {
+    if (match("REM")) {
+        // The rest of the line is the remark, spaces and all
+        if (!emit(0x5d)) return false;
+        while (*src) {
+            if (!emit(0x80 | *src++)) return false;
+        }
+        return true;
+    } else if (match("LET")) {
+        return emit(0x5e) && assignment();
+    } else if (match("PRINT")) {
+        return print_statement();
+    } else if (match("INPUT")) {
+        return input_statement();
+    } else if (match("IF")) {
+        if (!emit(0x60) || !expression()) return false;
+        if (!match("THEN")) {
+            return fail("expected THEN");
+        }
+        if (isdigit(peek())) {
+            return emit(0x24) && number();
+        }
+        return emit(0x25) && statement();
+    } else if (match("FOR")) {
+        if (!emit(0x55) || !variable_name()) return false;
+        if (!match("=")) {
+            return fail("expected =");
+        }
+        if (!emit(0x56) || !expression()) return false;
+        if (!match("TO")) {
+            return fail("expected TO");
+        }
+        if (!emit(0x57) || !expression()) return false;
+        if (match("STEP")) {
+            return emit(0x58) && expression();
+        }
+        return true;
+    } else if (match("NEXT")) {
+        if (!emit(0x59) || !variable_name()) return false;
+        while (match(",")) {
+            if (!emit(0x5a) || !variable_name()) return false;
+        }
+        return true;
+    } else if (match("GOTO")) {
+        return emit(0x5f) && expression();
+    } else if (match("GOSUB")) {
+        return emit(0x5c) && expression();
+    } else if (match("RETURN")) {
+        return emit(0x5b);
+    } else if (match("END")) {
+        return emit(0x51);
+    } else if (match("DIM")) {
+        return dim_statement();
+    } else if (match("POKE")) {
+        if (!emit(0x64) || !expression()) return false;
+        if (!match(",")) {
+            return fail("expected ,");
+        }
+        return emit(0x65) && expression();
+    } else if (match("CALL")) {
+        return emit(0x4d) && expression();
+    } else if (match("TAB")) {
+        return emit(0x50) && expression();
+    } else if (match("COLOR=")) {
+        return emit(0x66) && expression();
+    } else if (match("PLOT")) {
+        if (!emit(0x67) || !expression()) return false;
+        if (!match(",")) {
+            return fail("expected ,");
+        }
+        return emit(0x68) && expression();
+    } else if (match("HLIN")) {
+        if (!emit(0x69) || !expression()) return false;
+        if (!match(",")) {
+            return fail("expected ,");
+        }
+        if (!emit(0x6a) || !expression()) return false;
+        if (!match("AT")) {
+            return fail("expected AT");
+        }
+        return emit(0x6b) && expression();
+    }
+    return assignment();
+}
+
+/* Tokenizes the statements in text into tok, returns false and sets
+ * tok_error if the line has a syntax error */
+static bool tokenize_line(char *text) {
+    src = text;
+    tok_len = 0;
+    tok_error = NULL;
+
+    for (;;) {
+        if (!statement()) return false;
+        if (match(":")) {
+            if (!emit(TOK_COLON)) return false;
+        } else if (peek() == 0) {
+            tok[tok_len++] = TOK_EOL;
+            return true;
+        } else {
+            return fail("syntax error");
+        }
+    }
+}
+
+static int compare_lines(const void *a, const void *b) {
+    const struct basic_line *line_a = a;
+    const struct basic_line *line_b = b;
+
+    if (line_a->number != line_b->number) {
+        return line_a->number - line_b->number;
+    }
+    return line_a->order - line_b->order;
+}
+
+static uint16_t read_pointer(uint16_t addr) {
+    return ram[addr] | (ram[addr+1] << 8);
+}
+
+static void write_pointer(uint16_t addr, uint16_t value) {
+    ram[addr] = value & 0xff;
+    ram[addr+1] = value >> 8;
+}
+
+/* Checks for Woz BASIC's cold start jump at E000. rom[] can't tell,
+ * since everything above the RAM size is marked as ROM. */
+bool basic_loaded() {
+    return (ram[0xe000] == 0x4c) && (ram[0xe001] == 0xb0) && (ram[0xe002] == 0xe2);
+}
+
+/* Tokenizes a BASIC source file into the Woz BASIC program area */
+int load_basic(char *filename) {
+    FILE *in;
+    char line[1024];
+
+    if ((in = fopen(filename, "r")) == NULL) {
+        fprintf(stderr, "Can't open file %s\n", filename);
+        return 0;
+    }
+
+    struct basic_line *lines = NULL;
+    int line_count = 0;
+    int line_capacity = 0;
+    int file_line = 0;
+
+    while (fgets(line, sizeof(line), in)) {
+        file_line++;
+
+        // Apple-1 only supported uppercase
+        int len = strlen(line);
+        while ((len > 0) && ((line[len-1] == '\n') || (line[len-1] == '\r'))) {
+            line[--len] = 0;
+        }
+        for (int i=0; i < len; i++) {
+            line[i] = toupper(line[i]);
+        }
+
+        char *p = line;
+        while (*p == ' ') p++;
+        if (*p == 0) continue;
+
+        if (!isdigit(*p)) {
+            fprintf(stderr, "No line number in %s at line %d: %s\n", filename, file_line, line);
+            fclose(in);
+            free(lines);
+            return 0;
+        }
+        long number = 0;
+        while (isdigit(*p)) {
+            number = number * 10 + (*p++ - '0');
+            if (number > MAX_LINE_NUMBER) {
+                fprintf(stderr, "Line number too big in %s at line %d: %s\n", filename, file_line, line);
+                fclose(in);
+                free(lines);
+                return 0;
+            }
+        }
+
+        if (line_count == line_capacity) {
+            line_capacity = line_capacity ? line_capacity * 2 : 256;
+            struct basic_line *more = realloc(lines, line_capacity * sizeof(struct basic_line));
+            if (more == NULL) {
+                fprintf(stderr, "Out of memory loading %s\n", filename);
+                fclose(in);
+                free(lines);
+                return 0;
+            }
+            lines = more;
+        }
+        struct basic_line *curr = &lines[line_count++];
+        curr->number = number;
+        curr->order = file_line;
+
+        // A line number on its own deletes the line, like typing it in
+        while (*p == ' ') p++;
+        if (*p == 0) {
+            curr->len = 0;
+            continue;
+        }
+
+        if (!tokenize_line(p)) {
+            fprintf(stderr, "%s in %s at line %d: %s\n", tok_error, filename, file_line, line);
+            fclose(in);
+            free(lines);
+            return 0;
+        }
+        curr->len = tok_len + 3;
+        curr->bytes[0] = curr->len;
+        curr->bytes[1] = number & 0xff;
+        curr->bytes[2] = number >> 8;
+        memcpy(&curr->bytes[3], tok, tok_len);
+    }
+    fclose(in);
+
+    qsort(lines, line_count, sizeof(struct basic_line), compare_lines);
+
+    // Only the last version of each line number counts
+    int size = 0;
+    int kept = 0;
+    for (int i=0; i < line_count; i++) {
+        if ((i+1 < line_count) && (lines[i+1].number == lines[i].number)) continue;
+        if (lines[i].len == 0) continue;
+        lines[kept++] = lines[i];
+        size += lines[i].len;
+    }
+
+    // Use the current BASIC settings if it has been run, otherwise
+    // what its cold start would set up
+    uint16_t lomem = read_pointer(BASIC_LOMEM);
+    uint16_t himem = read_pointer(BASIC_HIMEM);
+    if ((himem == 0) || (himem <= lomem)) {
+        lomem = DEFAULT_LOMEM;
+        himem = DEFAULT_HIMEM;
+    }
+
+    // If the program doesn't fit, move HIMEM up through any free RAM
+    uint16_t old_himem = himem;
+    while ((himem - size < lomem) && (himem < 0xffff) && !rom[himem]) {
+        himem++;
+    }
+    if ((himem - size < lomem) || (size > himem)) {
+        fprintf(stderr, "Program in %s is too big, %d bytes with LOMEM at %04x and HIMEM at %04x\n",
+            filename, size, lomem, himem);
+        free(lines);
+        return 0;
+    }
+
+    uint16_t pp = himem - size;
+    for (int addr=pp; addr < himem; addr++) {
+        if (rom[addr]) {
+            fprintf(stderr, "Program in %s would overwrite ROM at %04x\n", filename, addr);
+            free(lines);
+            return 0;
+        }
+    }
+
+    uint16_t addr = pp;
+    for (int i=0; i < kept; i++) {
+        memcpy(&ram[addr], lines[i].bytes, lines[i].len);
+        addr += lines[i].len;
+    }
+    write_pointer(BASIC_LOMEM, lomem);
+    write_pointer(BASIC_HIMEM, himem);
+    write_pointer(BASIC_PP, pp);
+    write_pointer(BASIC_PV, lomem);     // no variables yet
+
+    printf("Loaded %d BASIC lines (%d bytes) at %04x-%04x from %s\n",
+        kept, size, pp, himem-1, filename);
+    if (himem != old_himem) {
+        printf("HIMEM raised from %04x to %04x to make room\n", old_himem, himem);
+    }
+    free(lines);
+    return 1;
+}
+
+// Text for each token when listing a program, NULL for tokens that
+// can't appear in a program line
+static const char *token_text[128] = {
+    [0x03] = ":",
+    [0x12] = "+", [0x13] = "-", [0x14] = "*", [0x15] = "/",
+    [0x16] = "=", [0x17] = "#", [0x18] = ">=", [0x19] = ">",
+    [0x1a] = "<=", [0x1b] = "<>", [0x1c] = "<",
+    [0x1d] = " AND ", [0x1e] = " OR ", [0x1f] = " MOD ", [0x20] = "^",
+    [0x22] = "(", [0x23] = ",", [0x24] = " THEN ", [0x25] = " THEN ",
+    [0x26] = ",", [0x27] = ",", [0x2a] = "(", [0x2d] = "(",
+    [0x2e] = "PEEK", [0x2f] = "RND", [0x30] = "SGN", [0x31] = "ABS",
+    [0x34] = "(", [0x35] = "+", [0x36] = "-", [0x37] = "NOT ",
+    [0x38] = "(", [0x39] = "=", [0x3a] = "#", [0x3b] = "LEN(",
+    [0x3f] = "(", [0x40] = "$", [0x42] = "(", [0x43] = ",", [0x44] = ",",
+    [0x45] = ";", [0x46] = ";", [0x47] = ";", [0x48] = ",", [0x49] = ",",
+    [0x4d] = "CALL ", [0x4e] = "DIM ", [0x4f] = "DIM ", [0x50] = "TAB ",
+    [0x51] = "END", [0x52] = "INPUT ", [0x53] = "INPUT ", [0x54] = "INPUT ",
+    [0x55] = "FOR ", [0x56] = "=", [0x57] = " TO ", [0x58] = " STEP ",
+    [0x59] = "NEXT ", [0x5a] = ",", [0x5b] = "RETURN", [0x5c] = "GOSUB ",
+    [0x5d] = "REM", [0x5e] = "LET ", [0x5f] = "GOTO ", [0x60] = "IF ",
+    [0x61] = "PRINT ", [0x62] = "PRINT ", [0x63] = "PRINT", [0x64] = "POKE ",
+    [0x65] = ",", [0x66] = "COLOR=", [0x67] = "PLOT ", [0x68] = ",",
+    [0x69] = "HLIN ", [0x6a] = ",", [0x6b] = " AT ",
+    [0x70] = "=", [0x71] = "=", [0x72] = ")"
+};
+
+/* Converts one tokenized line at addr to text, returns false if the
+ * line is damaged */
+static bool detokenize_line(uint16_t addr, char *text) {
+    int len = ram[addr];
+    int pos = 3;
+    char *out = text + sprintf(text, "%d ", ram[addr+1] | (ram[addr+2] << 8));
+    bool in_name = false;
+
+    while (pos < len) {
+        uint8_t token = ram[(uint16_t) (addr+pos++)];
+
+        if (token == TOK_EOL) {
+            *out = 0;
+            return pos == len;
+        } else if ((token >= 0xb0) && (token <= 0xb9) && !in_name) {
+            // A number, the value follows the first digit
+            if (pos + 2 > len) return false;
+            int value = ram[(uint16_t) (addr+pos)] | (ram[(uint16_t) (addr+pos+1)] << 8);
+            pos += 2;
+            // Keep any leading zeros that were typed in
+            if ((token == 0xb0) && (value != 0)) {
+                *out++ = '0';
+            }
+            out += sprintf(out, "%d", value);
+        } else if (token >= 0x80) {
+            // Variable name, a digit here is part of the name, not a number
+            *out++ = token & 0x7f;
+            in_name = true;
+            continue;
+        } else if (token == 0x28) {
+            *out++ = '"';
+            while ((pos < len) && (ram[(uint16_t) (addr+pos)] != 0x29)) {
+                *out++ = ram[(uint16_t) (addr+pos++)] & 0x7f;
+            }
+            if (pos++ >= len) return false;
+            *out++ = '"';
+        } else if (token == 0x5d) {
+            out += sprintf(out, "REM");
+            while ((pos < len) && (ram[(uint16_t) (addr+pos)] != TOK_EOL)) {
+                *out++ = ram[(uint16_t) (addr+pos++)] & 0x7f;
+            }
+        } else if (token_text[token] != NULL) {
+            out += sprintf(out, "%s", token_text[token]);
+        } else {
+            return false;
+        }
+        in_name = false;
+    }
+    return false;
+}
+
+/* Writes the Woz BASIC program in memory to out as text that load_basic
+ * can read back. Returns the number of lines written, or -1 if there
+ * is no valid program in memory. */
+int list_basic(FILE *out) {
+    // A line is at most 255 bytes, and no token expands to more than 7 chars
+    char text[2048];
+
+    uint16_t himem = read_pointer(BASIC_HIMEM);
+    uint16_t pp = read_pointer(BASIC_PP);
+    if ((himem == 0) || (pp > himem)) {
+        fprintf(stderr, "No Woz BASIC program in memory (PP=%04x, HIMEM=%04x)\n", pp, himem);
+        return -1;
+    }
+
+    int count = 0;
+    uint16_t addr = pp;
+    while (addr < himem) {
+        if ((ram[addr] < 4) || (addr + ram[addr] > himem) ||
+            !detokenize_line(addr, text)) {
+            fprintf(stderr, "Damaged BASIC line at %04x\n", addr);
+            return -1;
+        }
+        fputs(text, out);
+        fputc('\n', out);
+        count++;
+        addr += ram[addr];
+    }
+    return count;
+}